@@ -0,0 +1,106 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+
+#include "Image.h"
+#include "Parallel.h"
+#include "MappedCanvas.h"
+
+namespace ns
+{
+    // Combines placed images into one output image by averaging overlapping pixels.
+    // The output is produced in horizontal strips: only the sources intersecting a strip are
+    // loaded, the strip is accumulated in compact buffers and its rows are streamed to the file.
+    // Strips are as high as the memory budget allows after the loaded sources are accounted for.
+    // With a pool, sources are loaded in parallel and each strip is split into tiles of rows that
+    // are accumulated, normalized and quantized by the pool threads.
+    // Optionally the whole image is accumulated in a memory-mapped canvas file instead, which gives
+    // random access to the sums of all pixels at the cost of disk traffic.
+    // PPM files are streamed row by row, JPEG files are encoded from the whole output held in memory.
+    class Compositor
+    {
+    public:
+        static constexpr size_t DEFAULT_MEMORY_BUDGET = (size_t)1 << 30;
+        static constexpr int TILE_HEIGHT = 16;
+    public:
+        // Loads the pixels of a source into img, the image is released once the strips have passed it.
+        // Returns false if the source cannot be loaded, which fails the whole output.
+        // Called from the pool threads if there is a pool.
+        typedef std::function<bool (size_t source_index, Image& img)> LoadFunc;
+    public:
+        Compositor(int width, int height, size_t memory_budget = DEFAULT_MEMORY_BUDGET, TaskPool* p_pool = nullptr);
+    public:
+        // Rectangle in output coordinates, sources are identified by the order they are added in
+        void add_source(int x, int y, int width, int height);
+        // 8 or 16 bits per channel
+        void set_bit_depth(int bit_depth);
+        // Accumulates into a MappedCanvas at filepath, an empty path uses strips in memory
+        void set_canvas_path(const std::string& filepath);
+        bool write_ppm(const std::string& filepath, const LoadFunc& load);
+        // Whether the output has 8 bits and fits into half of the memory budget, which it is taken from
+        bool can_write_jpg() const;
+        bool write_jpg(const std::string& filepath, const LoadFunc& load, int quality = 100);
+    public:
+        int get_width() const;
+        int get_height() const;
+        // Height of the strips, chosen from the memory budget and the placement of the sources
+        int get_strip_height() const;
+    private:
+        struct Source
+        {
+            int x, y, width, height;
+        };
+        // Sums of the sources covering each pixel of a strip, one array per channel
+        struct StripBuffer
+        {
+            std::vector<float> r, g, b;
+            std::vector<uint16_t> n;
+        };
+        struct Progress
+        {
+            std::chrono::steady_clock::time_point t_start;
+            std::chrono::steady_clock::time_point t_last_report;
+            size_t n_loaded;
+        };
+    private:
+        // Receives the rows of the output from top to bottom
+        typedef std::function<bool (const uint8_t* row)> RowFunc;
+    private:
+        bool composite(const LoadFunc& load, const RowFunc& write_row);
+        bool composite_mapped(const LoadFunc& load, const RowFunc& write_row);
+        // Budget left for strips and sources
+        size_t get_working_budget() const;
+        std::vector<size_t> get_sources_by_y() const;
+        size_t get_source_bytes(int y0, int y1) const;
+        size_t get_output_bytes_per_pixel() const;
+        // Calls fn(begin, end) for chunks of [begin, end), on the pool if there is one
+        void run_chunks(int64_t begin, int64_t end, int64_t grain, const std::function<void (int64_t, int64_t)>& fn);
+        // Accumulates the rows [y0, y1) of a source into the strip starting at strip_y
+        void accumulate(const Image& img, const Source& src, int strip_y, int y0, int y1);
+        void accumulate(const Image& img, const Source& src, MappedCanvas& canvas, int y0, int y1);
+        // Divides by the coverage and quantizes the rows [row0, row1) of the strip into dst
+        void resolve_rows(int row0, int row1, uint8_t* dst) const;
+        void resolve_row(const MappedCanvas& canvas, int y, uint8_t* dst) const;
+        // Writes one pixel in the output format and returns the end of it
+        uint8_t* quantize(float r, float g, float b, uint16_t n, uint8_t* dst) const;
+        // Prints at most once a second unless forced
+        void report_progress(Progress& progress, int n_rows, bool force) const;
+    private:
+        static constexpr size_t STRIP_BYTES_PER_PIXEL = 3 * sizeof(float) + sizeof(uint16_t);
+    private:
+        int m_width;
+        int m_height;
+        size_t m_memory_budget;
+        size_t m_reserved_bytes; // Part of the budget held outside of the strips, e.g. the JPEG output
+        TaskPool* m_p_pool;
+        int m_bit_depth;
+        std::string m_canvas_path;
+        std::vector<Source> m_sources;
+        StripBuffer m_strip;
+    };
+}
@@ -1,9 +1,9 @@
 #pragma once
 
-#include <queue>
+#include <array>
+#include <atomic>
 #include <optional>
 #include <mutex>
-#include <memory>
 #include <condition_variable>
 #include <cassert>
 
@@ -11,28 +11,18 @@ namespace ns
 {
     enum class EventType
     {
+        None,
         MouseMove,
         MouseButton,
         Keyboard
     };
 
-    class Event
-    {
-    public:
-        Event() = default;
-    public:
-        template <typename T>
-        const T& as_type() const;
-    public:
-        virtual EventType get_type() const = 0;
-    };
-
-    class MouseMoveEvent : public Event
+    class MouseMoveEvent
     {
     public:
         MouseMoveEvent(float x, float y);
     public:
-        virtual EventType get_type() const override;
+        EventType get_type() const;
     public:
         float get_pos_x() const;
         float get_pos_y() const;
@@ -41,7 +31,7 @@ namespace ns
         float m_pos_y;
     };
 
-    class MouseButtonEvent : public Event
+    class MouseButtonEvent
     {
     public:
         enum class Button
@@ -51,7 +41,7 @@ namespace ns
     public:
         MouseButtonEvent(float x, float y, Button btn, State st);
     public:
-        virtual EventType get_type() const override;
+        EventType get_type() const;
     public:
         float get_pos_x() const;
         float get_pos_y() const;
@@ -64,7 +54,7 @@ namespace ns
         State m_state;
     };
 
-    class KeyboardEvent : public Event
+    class KeyboardEvent
     {
     public:
         enum class State
@@ -72,7 +62,7 @@ namespace ns
     public:
         KeyboardEvent(float x, float y, unsigned char key, State st);
     public:
-        virtual EventType get_type() const override;
+        EventType get_type() const;
     public:
         float get_pos_x() const;
         float get_pos_y() const;
@@ -85,25 +75,83 @@ namespace ns
         State m_state;
     };
 
+    // Tagged union of all event types, stored by value
+    class Event
+    {
+    public:
+        Event();
+        Event(const MouseMoveEvent& event);
+        Event(const MouseButtonEvent& event);
+        Event(const KeyboardEvent& event);
+    public:
+        template <typename T>
+        const T& as_type() const;
+    public:
+        EventType get_type() const;
+    private:
+        EventType m_type;
+        union
+        {
+            char m_none;
+            MouseMoveEvent m_mouse_move;
+            MouseButtonEvent m_mouse_button;
+            KeyboardEvent m_keyboard;
+        };
+    };
+
+    // Fixed-capacity single-producer (window callbacks) single-consumer (user thread) event ring.
+    // Pushing and popping do not allocate or lock, only a consumer blocked in pop() or wait() is woken through a condition variable.
+    // Consecutive mouse moves are merged when popped, the consumer only sees the latest position.
     class Events
     {
     public:
-        void push(const Event* pEvent);
-        std::unique_ptr<const Event> pop();
-        std::optional<std::unique_ptr<const Event>> try_pop();
+        static constexpr size_t CAPACITY = 256;
+        // Mouse moves only fill part of the ring, the rest is kept for buttons and keys, which must not be lost
+        static constexpr size_t MOUSE_MOVE_CAPACITY = CAPACITY / 2;
+    public:
+        // Returns false if the ring is full and the event has been dropped. Mouse moves are dropped
+        // once MOUSE_MOVE_CAPACITY events are pending, the following moves carry the latest position.
+        bool push(const Event& event);
+        Event pop();
+        std::optional<Event> try_pop();
+    public:
+        // Blocks until an event is available or wake() has been called
+        void wait();
+        // Wakes the consumer without an event (background work done, shutdown), may be called from any thread
+        void wake();
     private:
-        std::unique_ptr<const Event> pop_internal(std::unique_lock<std::mutex>& lock);
+        Event pop_internal();
+        bool is_empty() const;
+        bool is_ready();
+        void notify_consumer();
     private:
-        std::queue<const Event*> m_queue;
-        std::mutex m_queue_mtx;
-        std::condition_variable m_queue_cv;
+        std::array<Event, CAPACITY> m_ring;
+        std::atomic_size_t m_head = 0; // Next slot to read, only written by the consumer
+        std::atomic_size_t m_tail = 0; // Next slot to write, only written by the producer
+        std::atomic_bool m_consumer_waiting = false;
+        std::atomic_bool m_wake_pending = false;
+        std::mutex m_wait_mtx;
+        std::condition_variable m_wait_cv;
     };
 
-    template <typename T>
-    const T& Event::as_type() const
+    template <>
+    inline const MouseMoveEvent& Event::as_type<MouseMoveEvent>() const
+    {
+        assert(m_type == EventType::MouseMove && "Unable to convert event");
+        return m_mouse_move;
+    }
+
+    template <>
+    inline const MouseButtonEvent& Event::as_type<MouseButtonEvent>() const
+    {
+        assert(m_type == EventType::MouseButton && "Unable to convert event");
+        return m_mouse_button;
+    }
+
+    template <>
+    inline const KeyboardEvent& Event::as_type<KeyboardEvent>() const
     {
-        const T* p = dynamic_cast<const T*>(this);
-        assert(p && "Unable to convert event");
-        return *p;
+        assert(m_type == EventType::Keyboard && "Unable to convert event");
+        return m_keyboard;
     }
-}
\ No newline at end of file
+}
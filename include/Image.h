@@ -3,14 +3,25 @@
 #include <string>
 #include <vector>
 #include <mutex>
-#include <queue>
+#include <memory>
 #include <functional>
 
 #include "glIncludes.h"
 #include "Color.h"
+#include "TextureUploader.h"
+#include "TexturePool.h"
+#include "PixelBufferPool.h"
 
 namespace ns
 {
+    // Internal format of the texture of viewable images
+    enum class TextureFormat
+    {
+        RGBA8,  // Display only, values are clamped to [0, 1]
+        RGB16F, // Keeps values outside of [0, 1], e.g. for difference visualization
+    };
+
+    // Pixels are shared between copies and crops, and copied when one of them is written to
     class Image
     {
     public:
@@ -23,36 +34,70 @@ namespace ns
         Image& operator=(Image&& other);
     public:
         void put_pixel(const Color& c, int x, int y);
-        void push_changes() const;
+        // Row y for writing, the whole row is uploaded with the next push_changes
+        Color* get_mutable_row(int y);
+        // Uploads the changed region of the image downsampled by 2^level, a sharper texture is kept.
+        // With an uploader, the upload is streamed and may stop at its budget (returns false, the rest follows with the next call).
+        // A new level is uploaded into a texture of its own, which replaces the drawn one once complete.
+        bool push_changes(int level = 0, TextureUploader* p_uploader = nullptr) const;
+        void set_texture_format(TextureFormat format);
+        // Lets an image loaded for alignment only be drawn, its texture is created when it is first drawn or bound
+        void make_viewable() const;
     public:
         int get_width() const;
         int get_height() const;
         bool is_viewable() const;
+        // Level of the texture returned by get_texture()
+        int get_texture_level() const;
     public:
         const Color& get_pixel(int x, int y) const;
+        const Color* get_row(int y) const;
+        // View of a region of the image, sharing its pixels until either is written to
+        Image crop(int x, int y, int width, int height) const;
+        bool shares_pixels_with(const Image& other) const;
     public:
         void bind() const;
+        // Only completely uploaded textures are returned, 0 until the first upload is complete
+        GLuint get_texture() const;
     public:
         bool save_to_file(const std::string& filepath) const;
         static Image load_from_file(const std::string& filepath, bool make_viewable = true, std::function<Color (Color, float, float)> filter = [](Color c, float, float){ return c; });
+        // Whether the file exists and has a supported format, only its header is read
+        static bool can_load_from_file(const std::string& filepath);
     public:
+        // Hands the textures of destroyed images back to the pool, render thread only
         static void delete_pending_tex_objs();
+        static TexturePool& get_texture_pool();
     private:
         int pos_to_index(int x, int y) const;
+        std::shared_ptr<PixelBuffer> share_pixels() const;
+        // Gives the image its own compact copy of the pixels if they are shared, m_pixels_mtx must be locked
+        void make_unique();
+        void mark_dirty(int x0, int y0, int x1, int y1) const;
+        size_t get_texel_size() const;
+        // Writes texels [x0, x0 + width) x [y0, y0 + height) of the given level in the transfer format
+        void write_texels(int level, int x0, int y0, int width, int height, void* dst) const;
     private:
-        void gen_gl_data();
         void clear_gl_data();
     private:
         int m_width;
         int m_height;
-        std::vector<Color> m_pixels;
+        std::shared_ptr<PixelBuffer> m_p_pixels; // Acquired from the default PixelBufferPool
+        int m_offset; // Index of pixel (0, 0) in the buffer
+        int m_stride; // Pixels from one row to the next
         mutable std::mutex m_pixels_mtx;
         mutable bool m_has_unpushed_changes;
-        bool m_make_viewable;
+        mutable int m_dirty_x0, m_dirty_y0, m_dirty_x1, m_dirty_y1; // Changed region not uploaded yet
+        mutable int m_texture_level; // Downsampling level of m_texture, NO_TEXTURE_LEVEL if none
+        mutable int m_pending_texture_level; // Downsampling level of m_pending_texture, NO_TEXTURE_LEVEL if none
+        TextureFormat m_texture_format;
+        mutable bool m_make_viewable;
+    private:
+        mutable PooledTexture m_texture; // Complete texture that is drawn, id 0 if none
+        mutable PooledTexture m_pending_texture; // Being uploaded with a new level, the dirty region refers to it while it exists
     private:
-        GLuint m_textureObject;
+        static constexpr int NO_TEXTURE_LEVEL = 1 << 16;
     private:
-        static std::mutex s_tex_objs_to_delete_mtx;
-        static std::queue<GLuint> s_tex_objs_to_delete;
+        static TexturePool s_texture_pool;
     };
 }
\ No newline at end of file
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <unordered_map>
+
+namespace ns
+{
+    struct ImageID
+    {
+        int x, y;
+    };
+
+    bool operator==(const ImageID& iid1, const ImageID& iid2);
+    bool operator<(const ImageID& iid1, const ImageID& iid2);
+
+    struct ImageInfo
+    {
+        int pos_x, pos_y;
+        int width, height;
+        bool has_been_adjusted;
+        bool ignore;
+    };
+
+    // Refers to the fields of one grid slot, converts to an ImageInfo copy
+    struct ImageInfoRef
+    {
+        int& pos_x;
+        int& pos_y;
+        int& width;
+        int& height;
+        bool& has_been_adjusted;
+        bool& ignore;
+    public:
+        operator ImageInfo() const;
+    };
+
+    // Contiguous storage of the ImageInfo of all captures, one slot per capture.
+    // Hot fields are stored as separate arrays (SoA), so scans over positions, sizes or
+    // flags only touch the memory they need.
+    // Dense grids map an ID to slot x * size_y + y, sparse grids (irregular captures
+    // with missing images) only have slots for the given IDs and map them with a hash table.
+    // In both modes, slots are ordered by x, then y.
+    class ImageGrid
+    {
+    public:
+        static constexpr size_t npos = (size_t)-1;
+    public:
+        ImageGrid();
+        ImageGrid(int size_x, int size_y);
+        ImageGrid(int size_x, int size_y, std::vector<ImageID> ids);
+    public:
+        int get_size_x() const;
+        int get_size_y() const;
+        size_t size() const;
+        bool is_sparse() const;
+    public:
+        bool contains(const ImageID& img_id) const;
+        size_t find(const ImageID& img_id) const;
+        ImageID get_id(size_t slot) const;
+    public:
+        // Throws std::out_of_range if the ID has no slot
+        ImageInfoRef operator[](const ImageID& img_id);
+        ImageInfoRef at_slot(size_t slot);
+        ImageInfo get_info(size_t slot) const;
+        void set_info(size_t slot, const ImageInfo& img_info);
+    public:
+        const std::vector<int>& get_pos_x() const;
+        const std::vector<int>& get_pos_y() const;
+    public:
+        // Calls fn(const ImageID&, ImageInfoRef) for every slot in slot order
+        template <typename Func>
+        void for_each(Func&& fn);
+    private:
+        static uint64_t get_hash_key(const ImageID& img_id);
+    private:
+        struct Flags
+        {
+            bool has_been_adjusted;
+            bool ignore;
+        };
+    private:
+        int m_size_x;
+        int m_size_y;
+        bool m_is_sparse;
+        std::vector<ImageID> m_ids;
+        std::unordered_map<uint64_t, size_t> m_slots;
+        std::vector<int> m_pos_x;
+        std::vector<int> m_pos_y;
+        std::vector<int> m_width;
+        std::vector<int> m_height;
+        std::vector<Flags> m_flags;
+    };
+
+    template <typename Func>
+    void ImageGrid::for_each(Func&& fn)
+    {
+        for (size_t slot = 0; slot < size(); ++slot)
+            fn(get_id(slot), at_slot(slot));
+    }
+}
@@ -1,23 +1,82 @@
 #pragma once
 
+#include <vector>
+
 #include "Image.h"
 #include "Camera.h"
+#include "TextureUploader.h"
 
 namespace ns
 {
+    // Collects the images of a frame as instances and draws them in as few draw calls as possible.
+    // Consecutive instances sharing a texture (or having none, like borders) are drawn with one
+    // instanced call, the order of the instances is kept for blending.
+    // Instances outside of the camera view are culled, images are uploaded downsampled to about
+    // their size on screen. Uploads are streamed with a per-frame budget, images may appear over
+    // several frames (see has_pending_uploads).
     class ImageRenderer
     {
     public:
         ImageRenderer();
     public:
+        void begin(const Camera& cam);
+        void add(const Image& img, int x, int y, float opacity, bool has_border, Color border_color);
+        // Draws the part uv (u, v, width, height) of an image, e.g. a cell of an atlas, to a rectangle.
+        // Regions of one image added one after the other are drawn with a single call.
+        void add_region(const Image& img, const float uv[4], int x, int y, int width, int height, float opacity);
+        // Untextured outline of a rectangle
+        void add_border(int x, int y, int width, int height, Color border_color);
+        void end();
+    public:
+        // Draws a single image immediately
         void render(const Image& img, int x, int y, const Camera& cam, float opacity, bool has_border, Color border_color);
+    public:
+        int get_n_draw_calls() const;
+        int get_n_culled() const;
+        // Whether uploads have been deferred to the next frame
+        bool has_pending_uploads() const;
+        // Coarsest downsampling level that still has about one texel per screen pixel, valid after begin.
+        // For textures of texel_width x texel_height covering world_width x world_height on screen.
+        int get_texture_level(int texel_width, int texel_height, float world_width, float world_height) const;
+        // For images drawn at their size, one texel per world unit
+        int get_texture_level(int width, int height) const;
+    public:
+        // Visible world area of a camera, the view spans [-1, 1] in both directions
+        static void get_visible_rect(const Camera& cam, float& x, float& y, float& width, float& height);
+    private:
+        struct Instance
+        {
+            float rect[4]; // x, y, width, height
+            float uv[4]; // u, v, width, height of the drawn part of the texture
+            float opacity;
+            float border[4]; // rgb, has_border
+        };
+    private:
+        bool is_visible(float x, float y, float width, float height) const;
+        void add_instance(GLuint texture, const Instance& instance);
+        void flush();
     private:
         void generate_vertex_buffer();
+        void generate_vertex_array();
         void load_shader_program();
     private:
         static GLuint load_shader_from_source(GLuint shader_type, const char* src);
     private:
         GLuint m_vbo;
+        GLuint m_instance_vbo;
+        GLuint m_vao;
         GLuint m_shader_prog;
+        GLint m_u_camera;
+        GLint m_u_sampler;
+        GLint m_u_has_texture;
+    private:
+        Camera m_camera;
+        int m_viewport_width;
+        int m_viewport_height;
+        GLuint m_batch_texture;
+        std::vector<Instance> m_batch;
+        int m_n_draw_calls;
+        int m_n_culled;
+        TextureUploader m_uploader;
     };
-}
\ No newline at end of file
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+namespace ns
+{
+    // Accumulation buffer of a whole output image in a memory-mapped sparse file, so images larger
+    // than the memory can be composited with random access. The OS pages it in and out as needed.
+    // The canvas is split into tiles of TILE_SIZE x TILE_SIZE pixels, each holding the channel sums
+    // and the coverage as separate arrays and spanning whole pages. Tiles never written to stay
+    // holes in the file.
+    class MappedCanvas
+    {
+    public:
+        static constexpr int TILE_SIZE = 64;
+    public:
+        // Channel sums and coverage of TILE_SIZE consecutive pixels of a row within one tile
+        struct Span
+        {
+            float* r;
+            float* g;
+            float* b;
+            uint16_t* n;
+        };
+    public:
+        MappedCanvas();
+        MappedCanvas(const MappedCanvas&) = delete;
+        ~MappedCanvas();
+        MappedCanvas& operator=(const MappedCanvas&) = delete;
+    public:
+        // Creates the file, its contents start out as zero
+        bool create(const std::string& filepath, int width, int height);
+        // Unmaps and deletes the file
+        void close();
+    public:
+        // Span of row y in tile column tile_x, starting at pixel x = tile_x * TILE_SIZE
+        Span get_span(int tile_x, int y) const;
+        int get_width() const;
+        int get_height() const;
+        int get_n_tiles_x() const;
+        size_t get_file_size() const;
+    public:
+        // Scattered writes, read-ahead would only evict useful pages
+        void advise_random() const;
+        // Rows are read once from top to bottom
+        void advise_sequential() const;
+        // The rows [y0, y1) are not needed anymore, their pages and blocks are dropped
+        void discard_rows(int y0, int y1) const;
+    private:
+        static constexpr size_t TILE_PIXELS = (size_t)TILE_SIZE * TILE_SIZE;
+        static constexpr size_t TILE_BYTES = TILE_PIXELS * (3 * sizeof(float) + sizeof(uint16_t));
+    private:
+        std::string m_filepath;
+        int m_fd;
+        uint8_t* m_p_data;
+        size_t m_file_size;
+        int m_width;
+        int m_height;
+        int m_n_tiles_x;
+    };
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <mutex>
+#include <memory>
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <exception>
+#include <functional>
+#include <condition_variable>
+
+#include "ThreadPool.h"
+
+namespace ns
+{
+    typedef std::function<void ()> Task;
+    typedef ThreadPool<Task> TaskPool;
+
+    void push_task(TaskPool& pool, const Task& task, bool high_priority = false);
+
+    // Chunk size used when a grain <= 0 is passed to parallel_for/parallel_reduce
+    int64_t get_auto_grain(const TaskPool& pool, int64_t n_elements);
+
+    // Calls fn(chunk_begin, chunk_end) for consecutive chunks of 'grain' elements in [begin, end).
+    // The calling thread works on chunks as well, so nested calls from pool jobs cannot dead-lock.
+    // The first exception thrown by fn is rethrown on the calling thread.
+    template <typename Func>
+    void parallel_for(TaskPool& pool, int64_t begin, int64_t end, int64_t grain, Func&& fn, bool high_priority = false);
+
+    // Maps every chunk to a partial result and folds the partials in chunk order.
+    // Chunks only depend on the range and the grain, so the result does not depend on scheduling.
+    template <typename T, typename MapFunc, typename ReduceFunc>
+    T parallel_reduce(TaskPool& pool, int64_t begin, int64_t end, int64_t grain, T identity, MapFunc&& map, ReduceFunc&& reduce, bool high_priority = false);
+
+    namespace detail
+    {
+        class ParallelForState
+        {
+        public:
+            ParallelForState(int64_t n_chunks, std::function<void (int64_t)> run_chunk);
+        public:
+            void work();
+            void wait();
+        private:
+            const int64_t m_n_chunks;
+            const std::function<void (int64_t)> m_run_chunk;
+            std::atomic<int64_t> m_next_chunk;
+            int64_t m_n_chunks_done;
+            std::exception_ptr m_exception;
+            std::mutex m_mtx;
+            std::condition_variable m_con_var;
+        };
+    }
+
+    template <typename Func>
+    void parallel_for(TaskPool& pool, int64_t begin, int64_t end, int64_t grain, Func&& fn, bool high_priority)
+    {
+        if (end <= begin)
+            return;
+
+        if (grain <= 0)
+            grain = get_auto_grain(pool, end - begin);
+
+        int64_t n_chunks = (end - begin + grain - 1) / grain;
+
+        // fn is only referenced while a chunk is running, and this function
+        // does not return before every chunk has finished.
+        auto state = std::make_shared<detail::ParallelForState>(
+            n_chunks,
+            [&fn, begin, end, grain](int64_t chunk)
+            {
+                int64_t chunk_begin = begin + chunk * grain;
+                fn(chunk_begin, std::min(chunk_begin + grain, end));
+            }
+        );
+
+        int64_t n_helpers = std::min<int64_t>(n_chunks - 1, pool.get_n_threads());
+        for (int64_t i = 0; i < n_helpers; ++i)
+            push_task(pool, [state]{ state->work(); }, high_priority);
+
+        state->work();
+        state->wait();
+    }
+
+    template <typename T, typename MapFunc, typename ReduceFunc>
+    T parallel_reduce(TaskPool& pool, int64_t begin, int64_t end, int64_t grain, T identity, MapFunc&& map, ReduceFunc&& reduce, bool high_priority)
+    {
+        if (end <= begin)
+            return identity;
+
+        if (grain <= 0)
+            grain = get_auto_grain(pool, end - begin);
+
+        std::vector<T> partials((end - begin + grain - 1) / grain, identity);
+
+        parallel_for(
+            pool, begin, end, grain,
+            [&](int64_t chunk_begin, int64_t chunk_end)
+            {
+                partials[(chunk_begin - begin) / grain] = map(chunk_begin, chunk_end);
+            },
+            high_priority
+        );
+
+        T result = identity;
+        for (auto& partial : partials)
+            result = reduce(result, partial);
+
+        return result;
+    }
+}
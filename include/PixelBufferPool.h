@@ -0,0 +1,82 @@
+#pragma once
+
+#include <map>
+#include <vector>
+#include <utility>
+#include <mutex>
+#include <cstddef>
+
+#include "Color.h"
+
+namespace ns
+{
+    // Recycles large pixel buffers by size class. All captures of a roll have the same size, so a
+    // buffer freed by evicting an image is reused by the next load without new page faults.
+    // Buffers are mapped separately and optionally backed by transparent huge pages.
+    // Free buffers exceeding the budget are unmapped, least recently released first.
+    class PixelBufferPool
+    {
+    public:
+        static constexpr size_t DEFAULT_BUDGET = (size_t)1 << 30;
+        static constexpr size_t MIN_POOLED_SIZE = (size_t)1 << 20; // Smaller buffers use the heap
+        static constexpr size_t HUGE_PAGE_SIZE = (size_t)2 << 20;
+    public:
+        struct Usage
+        {
+            size_t n_in_use, bytes_in_use;
+            size_t n_free, bytes_free;
+            size_t n_allocated, n_recycled, n_unmapped;
+        };
+    public:
+        PixelBufferPool(size_t budget = DEFAULT_BUDGET);
+        PixelBufferPool(const PixelBufferPool&) = delete;
+        ~PixelBufferPool();
+        PixelBufferPool& operator=(const PixelBufferPool&) = delete;
+    public:
+        // The contents of the returned memory are undefined
+        void* acquire(size_t size);
+        void release(void* p, size_t size);
+    public:
+        void set_budget(size_t budget);
+        size_t get_budget() const;
+        void set_use_huge_pages(bool use_huge_pages);
+        Usage get_usage() const;
+        void print_usage() const;
+    public:
+        static PixelBufferPool& get_default();
+        // Minor and major page faults of the process so far
+        static long get_page_faults();
+    private:
+        static size_t get_size_class(size_t size);
+        void* map(size_t size_class);
+        void unmap(void* p, size_t size_class);
+        void trim();
+    private:
+        mutable std::mutex m_mtx;
+        size_t m_budget;
+        bool m_use_huge_pages;
+        std::map<size_t, std::vector<void*>> m_free;
+        std::vector<std::pair<size_t, void*>> m_free_order; // Oldest first, unmapped first when over budget
+        Usage m_usage;
+    };
+
+    // Pixel storage of an image, acquired from the default pool
+    class PixelBuffer
+    {
+    public:
+        // Pixels are left uninitialized
+        PixelBuffer(size_t size);
+        PixelBuffer(const PixelBuffer&) = delete;
+        ~PixelBuffer();
+        PixelBuffer& operator=(const PixelBuffer&) = delete;
+    public:
+        Color* data() { return m_data; }
+        const Color* data() const { return m_data; }
+        size_t size() const { return m_size; }
+        Color& operator[](size_t i) { return m_data[i]; }
+        const Color& operator[](size_t i) const { return m_data[i]; }
+    private:
+        Color* m_data;
+        size_t m_size;
+    };
+}
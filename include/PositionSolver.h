@@ -0,0 +1,48 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+
+namespace ns
+{
+    // Weighted least-squares solver for node positions given pairwise offsets:
+    //   minimize sum(weight * |(pos_b - pos_a) - offset|^2)
+    // Solved per axis with a Jacobi preconditioned conjugate gradient on the sparse
+    // graph Laplacian. Fixed nodes keep their initial position, every connected
+    // component without a fixed node gets its first node fixed.
+    class PositionSolver
+    {
+    public:
+        struct Constraint
+        {
+            size_t node_a, node_b;
+            double off_x, off_y;
+            double weight;
+        };
+    public:
+        PositionSolver(size_t n_nodes);
+    public:
+        void set_initial_pos(size_t node, double x, double y);
+        void fix_node(size_t node);
+        void add_constraint(size_t node_a, size_t node_b, double off_x, double off_y, double weight);
+    public:
+        // Returns whether both axes converged within max_iter iterations (0 selects a default)
+        bool solve(int max_iter = 0, double tolerance = 1e-6);
+    public:
+        double get_pos_x(size_t node) const;
+        double get_pos_y(size_t node) const;
+        int get_n_iterations() const;
+        double get_rms_residual() const;
+    private:
+        void fix_unanchored_components();
+        bool solve_axis(std::vector<double>& pos, bool axis_y, int max_iter, double tolerance);
+        void multiply(const std::vector<double>& x, std::vector<double>& y) const;
+    private:
+        size_t m_n_nodes;
+        std::vector<double> m_pos_x;
+        std::vector<double> m_pos_y;
+        std::vector<bool> m_is_fixed;
+        std::vector<Constraint> m_constraints;
+        int m_n_iterations;
+    };
+}
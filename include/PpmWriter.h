@@ -0,0 +1,30 @@
+#pragma once
+
+#include <string>
+#include <fstream>
+#include <cstdint>
+
+namespace ns
+{
+    // Writes a binary PPM (P6) row by row, so an image never has to be held in memory as a whole.
+    // Samples have 8 or 16 bits, 16 bit samples are big-endian.
+    class PpmWriter
+    {
+    public:
+        PpmWriter();
+    public:
+        bool open(const std::string& filepath, int width, int height, int bit_depth = 8);
+        // Rows are written top to bottom, 3 samples per pixel
+        bool write_row(const uint8_t* rgb);
+        // Fails if fewer rows than the image height were written
+        bool close();
+    public:
+        int get_n_rows_written() const;
+    private:
+        std::ofstream m_file;
+        int m_width;
+        int m_height;
+        int m_bytes_per_sample;
+        int m_n_rows_written;
+    };
+}
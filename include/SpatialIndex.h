@@ -0,0 +1,51 @@
+#pragma once
+
+#include <mutex>
+#include <vector>
+#include <cstdint>
+#include <optional>
+#include <functional>
+#include <unordered_map>
+
+namespace ns
+{
+    // Uniform bucket grid over axis aligned rectangles, identified by a key.
+    // Every rectangle is registered in all cells it covers, so overlap queries only
+    // visit the cells around the query and nearest queries search outwards ring by ring.
+    class SpatialIndex
+    {
+    public:
+        struct Rect
+        {
+            int x, y;
+            int w, h;
+        };
+    public:
+        SpatialIndex(int cell_size = 1024);
+    public:
+        void update(size_t key, const Rect& rect);
+        void remove(size_t key);
+        void clear();
+        // Rebuilds the index, best chosen close to the typical rectangle size
+        void set_cell_size(int cell_size);
+    public:
+        size_t size() const;
+        bool contains(size_t key) const;
+        // Keys of all rectangles intersecting rect
+        std::vector<size_t> query_rect(const Rect& rect) const;
+        // Key of the rectangle with the center closest to x/y, for which filter returns true
+        std::optional<size_t> query_nearest(int x, int y, std::function<bool (size_t)> filter = nullptr) const;
+    private:
+        void insert_cells(size_t key, const Rect& rect);
+        void remove_cells(size_t key, const Rect& rect);
+        int get_cell_coord(int v) const;
+        static uint64_t get_cell_key(int cell_x, int cell_y);
+    private:
+        int m_cell_size;
+        int m_min_cell_x, m_min_cell_y;
+        int m_max_cell_x, m_max_cell_y;
+        std::unordered_map<size_t, Rect> m_rects;
+        std::unordered_map<uint64_t, std::vector<size_t>> m_cells;
+        mutable std::mutex m_mtx;
+    };
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <map>
+#include <vector>
+#include <tuple>
+#include <mutex>
+#include <cstddef>
+
+#include "glIncludes.h"
+
+namespace ns
+{
+    struct PooledTexture
+    {
+        GLuint id;
+        int width, height;
+        GLenum internal_format;
+    public:
+        size_t get_size() const;
+    };
+
+    // Recycles texture objects by size and internal format. Textures are released from any thread
+    // and only reused or deleted by the render thread in collect(). Free textures exceeding the
+    // memory budget are deleted, least recently released first.
+    class TexturePool
+    {
+    public:
+        static constexpr size_t DEFAULT_BUDGET = (size_t)512 << 20;
+    public:
+        struct Usage
+        {
+            size_t n_in_use, bytes_in_use;
+            size_t n_free, bytes_free;
+            size_t n_allocated, n_recycled, n_deleted;
+        };
+    public:
+        TexturePool(size_t budget = DEFAULT_BUDGET);
+    public:
+        // Render thread only. The storage of a new texture is allocated with format/type, its contents are undefined
+        // and recycled ones still hold the pixels of their previous user, so they must be uploaded completely before being drawn.
+        PooledTexture acquire(int width, int height, GLenum internal_format, GLenum format, GLenum type);
+        // May be called from any thread
+        void release(const PooledTexture& texture);
+        // Render thread only
+        void collect();
+    public:
+        void set_budget(size_t budget);
+        size_t get_budget() const;
+        Usage get_usage() const;
+        void print_usage() const;
+    private:
+        void trim();
+    private:
+        typedef std::tuple<int, int, GLenum> Key;
+    private:
+        mutable std::mutex m_mtx;
+        size_t m_budget;
+        std::vector<PooledTexture> m_released;
+        std::map<Key, std::vector<PooledTexture>> m_free;
+        std::vector<PooledTexture> m_free_order; // Oldest first, deleted first when over budget
+        Usage m_usage;
+        bool m_has_warned_budget;
+    };
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+#include <functional>
+
+#include "glIncludes.h"
+
+namespace ns
+{
+    // Streams texture data through a ring of pixel buffer objects, so the driver copies into the
+    // texture asynchronously. Uploads are limited by a byte budget per frame, work exceeding it
+    // is deferred to the following frames. Must only be used on the render thread.
+    class TextureUploader
+    {
+    public:
+        static constexpr size_t DEFAULT_FRAME_BUDGET = 32 << 20;
+    public:
+        TextureUploader(size_t frame_budget = DEFAULT_FRAME_BUDGET, int n_buffers = 4);
+        ~TextureUploader();
+        TextureUploader(const TextureUploader&) = delete;
+        TextureUploader& operator=(const TextureUploader&) = delete;
+    public:
+        void begin_frame();
+        size_t get_budget_left() const;
+        // Budget of a frame in which nothing has been uploaded yet
+        bool is_budget_untouched() const;
+        // Called by users that stopped because the budget ran out
+        void defer();
+        bool has_deferred() const;
+        size_t get_bytes_uploaded() const;
+    public:
+        // Maps a buffer of size bytes, lets fill write the pixels and uploads them to the region of the texture
+        void upload(GLuint texture, int x, int y, int width, int height, GLenum format, GLenum type, size_t size, const std::function<void (void*)>& fill);
+    private:
+        size_t m_frame_budget;
+        size_t m_bytes_uploaded;
+        bool m_has_deferred;
+        std::vector<GLuint> m_buffers;
+        size_t m_next_buffer;
+    };
+}
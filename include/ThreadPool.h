@@ -1,8 +1,10 @@
 #pragma once
 
+#include <mutex>
 #include <thread>
 #include <atomic>
 #include <deque>
+#include <optional>
 #include <vector>
 #include <cstddef>
 #include <iostream>
@@ -26,6 +28,7 @@ namespace ns
         ~ThreadPool();
     public:
         bool is_idle() const;
+        size_t get_n_threads() const;
         void wait_idle() const;
         void push_job(const Job& job);
         void push_priority_job(const Job& job);
@@ -45,6 +48,7 @@ namespace ns
     ThreadPool<T>::ThreadPool(size_t n_threads)
     {
         m_stop_threads = false;
+        m_n_jobs_running = 0;
 
         while (n_threads-- > 0)
             m_threads.push_back(std::thread(&ThreadPool::worker_func, this));
@@ -69,6 +73,12 @@ namespace ns
         return m_jobs.empty() && m_n_jobs_running == 0;
     }
 
+    template <typename T>
+    size_t ThreadPool<T>::get_n_threads() const
+    {
+        return m_threads.size();
+    }
+
 
     template <typename T>
     void ThreadPool<T>::push_job(const Job& job)
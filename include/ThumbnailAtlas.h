@@ -0,0 +1,61 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <cstdint>
+
+#include "Image.h"
+
+namespace ns
+{
+    // Small thumbnails of all captures of a roll in a single image, so the whole roll can be drawn
+    // from one texture. Cell (x, y) holds the thumbnail of capture x/y.
+    // Thumbnails can be added from any thread, the atlas is uploaded as they arrive.
+    class ThumbnailAtlas
+    {
+    public:
+        static constexpr int THUMBNAIL_SIZE = 64; // Longer side of a cell
+        static constexpr int MAX_ATLAS_SIZE = 8192;
+    public:
+        ThumbnailAtlas(int size_x, int size_y, int capture_width, int capture_height);
+    public:
+        // Downsamples a capture into its cell
+        void set_thumbnail(int id_x, int id_y, const Image& capture);
+        bool has_thumbnail(int id_x, int id_y) const;
+        int get_n_thumbnails() const;
+    public:
+        const Image& get_image() const;
+        // Texture coordinates of a cell: u, v, width, height
+        void get_cell_uv(int id_x, int id_y, float uv[4]) const;
+        // Downsampling level of the thumbnails relative to the captures
+        int get_level() const;
+        int get_size_x() const;
+        int get_size_y() const;
+        int get_capture_width() const;
+        int get_capture_height() const;
+    public:
+        bool save_to_file(const std::string& filepath) const;
+        // Fails if the file is missing or was made for a different grid or capture size
+        bool load_from_file(const std::string& filepath);
+    private:
+        struct FileHeader
+        {
+            char magic[4];
+            uint32_t version;
+            int32_t size_x, size_y;
+            int32_t capture_width, capture_height;
+            int32_t cell_width, cell_height;
+        };
+    private:
+        static constexpr uint32_t FILE_VERSION = 1;
+    private:
+        int m_size_x, m_size_y;
+        int m_capture_width, m_capture_height;
+        int m_cell_width, m_cell_height;
+        Image m_img;
+        std::vector<bool> m_has_thumbnail;
+        int m_n_thumbnails;
+        mutable std::mutex m_mtx;
+    };
+}
@@ -4,6 +4,9 @@
 #include <string>
 #include <memory>
 #include <thread>
+#include <atomic>
+#include <mutex>
+#include <cstdint>
 #include <functional>
 
 #include "glIncludes.h"
@@ -12,6 +15,15 @@
 
 namespace ns
 {
+    struct FrameStats
+    {
+        uint64_t n_frames;
+        float avg_ms;
+        float max_ms;
+        float last_ms;
+    };
+
+    // Redraws only after invalidate() has been called, at most once per frame interval
     class Window
     {
     public:
@@ -19,8 +31,20 @@ namespace ns
         virtual ~Window();
     public:
         void set_render_func(std::function<void ()> render_func);
+    public:
+        // Requests a redraw, may be called from any thread
+        void invalidate();
+        // Maximum number of frames per second, 0 disables the cap. Redraws are still only checked for
+        // every MIN_TIMER_INTERVAL_MS.
+        void set_frame_cap(int max_fps);
+        FrameStats get_frame_stats() const;
+        void reset_frame_stats();
+    private:
+        static constexpr int MIN_TIMER_INTERVAL_MS = 4;
     private:
         void cb_render_scene();
+        void cb_timer();
+        static void timer_callback(int value);
         void cb_mouse_move_event(int x, int y);
         void cb_mouse_button_event(int button, int state, int x, int y);
         void cb_keyboard_down_event(unsigned char key, int x, int y);
@@ -31,9 +55,14 @@ namespace ns
     private:
         int m_width;
         int m_height;
-        bool m_is_alive;
+        std::atomic_bool m_is_alive;
+        std::atomic_bool m_is_dirty;
+        std::atomic_int m_frame_cap;
         std::thread m_user_thread;
         std::function<void ()> m_render_func;
         Events m_events;
+    private:
+        mutable std::mutex m_frame_stats_mtx;
+        FrameStats m_frame_stats;
     };
 }
\ No newline at end of file
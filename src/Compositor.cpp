@@ -0,0 +1,475 @@
+#include "Compositor.h"
+
+#include <algorithm>
+#include <numeric>
+#include <chrono>
+#include <atomic>
+#include <cstdio>
+
+#include "PpmWriter.h"
+#include "vendor/stb_image_write.h"
+
+namespace ns
+{
+    Compositor::Compositor(int width, int height, size_t memory_budget, TaskPool* p_pool)
+        : m_width(width), m_height(height),
+          m_memory_budget(memory_budget),
+          m_reserved_bytes(0),
+          m_p_pool(p_pool),
+          m_bit_depth(8)
+    {}
+
+    void Compositor::add_source(int x, int y, int width, int height)
+    {
+        m_sources.push_back({ x, y, width, height });
+    }
+
+    void Compositor::set_bit_depth(int bit_depth)
+    {
+        m_bit_depth = bit_depth > 8 ? 16 : 8;
+    }
+
+    void Compositor::set_canvas_path(const std::string& filepath)
+    {
+        m_canvas_path = filepath;
+    }
+
+    bool Compositor::write_ppm(const std::string& filepath, const LoadFunc& load)
+    {
+        PpmWriter writer;
+        if (!writer.open(filepath, m_width, m_height, m_bit_depth))
+            return false;
+
+        auto write_row = [&](const uint8_t* row) { return writer.write_row(row); };
+
+        bool success = m_canvas_path.empty() ? composite(load, write_row) : composite_mapped(load, write_row);
+
+        return writer.close() && success;
+    }
+
+    bool Compositor::can_write_jpg() const
+    {
+        return m_bit_depth == 8 && (size_t)m_width * m_height * get_output_bytes_per_pixel() <= m_memory_budget / 2;
+    }
+
+    bool Compositor::write_jpg(const std::string& filepath, const LoadFunc& load, int quality)
+    {
+        if (!can_write_jpg())
+        {
+            printf("Unable to write %dx%d pixels at %d bits as JPEG within %lu MiB\n", m_width, m_height, m_bit_depth, m_memory_budget >> 20);
+            return false;
+        }
+
+        size_t row_size = (size_t)m_width * get_output_bytes_per_pixel();
+        std::vector<uint8_t> data(row_size * m_height);
+        size_t n_rows = 0;
+
+        auto write_row = [&](const uint8_t* row)
+        {
+            std::copy(row, row + row_size, data.data() + n_rows++ * row_size);
+            return true;
+        };
+
+        m_reserved_bytes = data.size();
+        bool success = m_canvas_path.empty() ? composite(load, write_row) : composite_mapped(load, write_row);
+        m_reserved_bytes = 0;
+
+        if (!success)
+            return false;
+
+        printf("Encoding JPEG...\n");
+
+        return stbi_write_jpg(filepath.c_str(), m_width, m_height, 3, data.data(), quality);
+    }
+
+    bool Compositor::composite(const LoadFunc& load, const RowFunc& write_row)
+    {
+        int strip_height = get_strip_height();
+        size_t strip_size = (size_t)m_width * strip_height;
+        size_t row_size = (size_t)m_width * get_output_bytes_per_pixel();
+
+        printf("Compositing %dx%d pixels at %d bits in strips of %d rows (%lu MiB per strip, budget %lu MiB)\n",
+            m_width, m_height, m_bit_depth, strip_height,
+            (strip_size * (STRIP_BYTES_PER_PIXEL + get_output_bytes_per_pixel())) >> 20, get_working_budget() >> 20);
+
+        m_strip.r.resize(strip_size);
+        m_strip.g.resize(strip_size);
+        m_strip.b.resize(strip_size);
+        m_strip.n.resize(strip_size);
+
+        std::vector<uint8_t> strip_data(row_size * strip_height);
+
+        // Sources are loaded in the order the strips reach them
+        std::vector<size_t> order = get_sources_by_y();
+
+        std::vector<std::pair<size_t, Image>> active;
+        size_t next_source = 0;
+
+        auto t_start = std::chrono::steady_clock::now();
+        Progress progress = { t_start, t_start, 0 };
+
+        for (int strip_y = 0; strip_y < m_height; strip_y += strip_height)
+        {
+            int height = std::min(strip_height, m_height - strip_y);
+
+            size_t n_active_before = active.size();
+            while (next_source < order.size() && m_sources[order[next_source]].y < strip_y + height)
+            {
+                size_t index = order[next_source++];
+
+                if (m_sources[index].y + m_sources[index].height > strip_y)
+                    active.push_back({ index, Image() });
+            }
+
+            std::atomic_bool has_failed = false;
+            run_chunks(n_active_before, active.size(), 1,
+                [&](int64_t begin, int64_t end)
+                {
+                    for (int64_t i = begin; i < end; ++i)
+                        if (!load(active[i].first, active[i].second))
+                            has_failed = true;
+                }
+            );
+            if (has_failed)
+                return false;
+            progress.n_loaded += active.size() - n_active_before;
+
+            // Tiles own their rows, so no two threads touch the same sums
+            run_chunks(0, height, TILE_HEIGHT,
+                [&](int64_t row0, int64_t row1)
+                {
+                    size_t begin = (size_t)row0 * m_width;
+                    size_t end = (size_t)row1 * m_width;
+
+                    std::fill(m_strip.r.begin() + begin, m_strip.r.begin() + end, 0.0f);
+                    std::fill(m_strip.g.begin() + begin, m_strip.g.begin() + end, 0.0f);
+                    std::fill(m_strip.b.begin() + begin, m_strip.b.begin() + end, 0.0f);
+                    std::fill(m_strip.n.begin() + begin, m_strip.n.begin() + end, 0);
+
+                    for (auto& [index, img] : active)
+                        accumulate(img, m_sources[index], strip_y, strip_y + (int)row0, strip_y + (int)row1);
+
+                    resolve_rows((int)row0, (int)row1, strip_data.data() + row0 * row_size);
+                }
+            );
+
+            // Sources ending in this strip are not needed anymore
+            active.erase(
+                std::remove_if(active.begin(), active.end(),
+                    [&](const std::pair<size_t, Image>& p) { return m_sources[p.first].y + m_sources[p.first].height <= strip_y + height; }),
+                active.end()
+            );
+
+            for (int y = 0; y < height; ++y)
+                if (!write_row(strip_data.data() + y * row_size))
+                    return false;
+
+            report_progress(progress, strip_y + height, strip_y + height == m_height);
+        }
+
+        return true;
+    }
+
+    bool Compositor::composite_mapped(const LoadFunc& load, const RowFunc& write_row)
+    {
+        MappedCanvas canvas;
+        if (!canvas.create(m_canvas_path, m_width, m_height))
+            return false;
+
+        size_t row_size = (size_t)m_width * get_output_bytes_per_pixel();
+
+        printf("Compositing %dx%d pixels at %d bits on canvas %s (%lu MiB sparse file, budget %lu MiB)\n",
+            m_width, m_height, m_bit_depth, m_canvas_path.c_str(), canvas.get_file_size() >> 20, get_working_budget() >> 20);
+
+        std::vector<size_t> order = get_sources_by_y();
+
+        auto t_start = std::chrono::steady_clock::now();
+        Progress progress = { t_start, t_start, 0 };
+
+        // Sources are loaded in parallel in batches that fit into the budget. Overlapping sources
+        // cannot be accumulated at the same time, so the rows of each source are split instead.
+        canvas.advise_random();
+
+        for (size_t batch_begin = 0; batch_begin < order.size();)
+        {
+            size_t batch_end = batch_begin;
+            size_t batch_bytes = 0;
+            while (batch_end < order.size())
+            {
+                auto& src = m_sources[order[batch_end]];
+                size_t bytes = (size_t)src.width * src.height * sizeof(Color);
+
+                if (batch_end > batch_begin && batch_bytes + bytes > get_working_budget())
+                    break;
+
+                batch_bytes += bytes;
+                ++batch_end;
+            }
+
+            std::vector<Image> batch(batch_end - batch_begin);
+            std::atomic_bool has_failed = false;
+            run_chunks(0, batch.size(), 1,
+                [&](int64_t begin, int64_t end)
+                {
+                    for (int64_t i = begin; i < end; ++i)
+                        if (!load(order[batch_begin + i], batch[i]))
+                            has_failed = true;
+                }
+            );
+            if (has_failed)
+                return false;
+
+            for (size_t i = 0; i < batch.size(); ++i)
+            {
+                auto& src = m_sources[order[batch_begin + i]];
+
+                run_chunks(src.y, src.y + src.height, TILE_HEIGHT,
+                    [&](int64_t y0, int64_t y1) { accumulate(batch[i], src, canvas, (int)y0, (int)y1); }
+                );
+            }
+
+            progress.n_loaded += batch.size();
+            batch_begin = batch_end;
+
+            printf("\e[0E\e[K[%lu/%lu sources accumulated]", progress.n_loaded, order.size());
+            fflush(stdout);
+        }
+
+        printf("\n");
+
+        // Rows are resolved one tile row at a time, finished tile rows are dropped from the file
+        canvas.advise_sequential();
+
+        std::vector<uint8_t> band_data(row_size * MappedCanvas::TILE_SIZE);
+
+        for (int band_y = 0; band_y < m_height; band_y += MappedCanvas::TILE_SIZE)
+        {
+            int height = std::min(MappedCanvas::TILE_SIZE, m_height - band_y);
+
+            run_chunks(0, height, 1,
+                [&](int64_t row0, int64_t row1)
+                {
+                    for (int64_t y = row0; y < row1; ++y)
+                        resolve_row(canvas, band_y + (int)y, band_data.data() + y * row_size);
+                }
+            );
+
+            for (int y = 0; y < height; ++y)
+                if (!write_row(band_data.data() + y * row_size))
+                    return false;
+
+            canvas.discard_rows(band_y, band_y + height);
+
+            report_progress(progress, band_y + height, band_y + height == m_height);
+        }
+
+        return true;
+    }
+
+    int Compositor::get_width() const
+    {
+        return m_width;
+    }
+
+    int Compositor::get_height() const
+    {
+        return m_height;
+    }
+
+    int Compositor::get_strip_height() const
+    {
+        if (m_width <= 0 || m_height <= 0)
+            return 1;
+
+        size_t budget = get_working_budget();
+        size_t row_bytes = (size_t)m_width * (STRIP_BYTES_PER_PIXEL + get_output_bytes_per_pixel());
+        int strip_height = (int)std::clamp(budget / row_bytes, (size_t)1, (size_t)m_height);
+
+        // Lower strips need fewer sources at a time, shrink until the fullest strip fits
+        while (strip_height > 1)
+        {
+            size_t max_source_bytes = 0;
+            for (int y = 0; y < m_height; y += strip_height)
+                max_source_bytes = std::max(max_source_bytes, get_source_bytes(y, y + strip_height));
+
+            if (strip_height * row_bytes + max_source_bytes <= budget)
+                break;
+
+            strip_height = strip_height * 3 / 4;
+        }
+
+        return std::max(strip_height, 1);
+    }
+
+    std::vector<size_t> Compositor::get_sources_by_y() const
+    {
+        std::vector<size_t> order(m_sources.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return m_sources[a].y < m_sources[b].y; });
+
+        return order;
+    }
+
+    size_t Compositor::get_source_bytes(int y0, int y1) const
+    {
+        size_t bytes = 0;
+
+        for (auto& src : m_sources)
+            if (src.y < y1 && src.y + src.height > y0)
+                bytes += (size_t)src.width * src.height * sizeof(Color);
+
+        return bytes;
+    }
+
+    size_t Compositor::get_working_budget() const
+    {
+        return m_memory_budget - std::min(m_reserved_bytes, m_memory_budget);
+    }
+
+    size_t Compositor::get_output_bytes_per_pixel() const
+    {
+        return 3 * (m_bit_depth / 8);
+    }
+
+    void Compositor::run_chunks(int64_t begin, int64_t end, int64_t grain, const std::function<void (int64_t, int64_t)>& fn)
+    {
+        if (m_p_pool)
+        {
+            parallel_for(*m_p_pool, begin, end, grain, fn);
+            return;
+        }
+
+        for (int64_t chunk_begin = begin; chunk_begin < end; chunk_begin += grain)
+            fn(chunk_begin, std::min(chunk_begin + grain, end));
+    }
+
+    void Compositor::accumulate(const Image& img, const Source& src, int strip_y, int y0, int y1)
+    {
+        int y_begin = std::max(src.y, y0);
+        int y_end = std::min({ src.y + src.height, src.y + img.get_height(), y1 });
+
+        int x_begin = std::max(src.x, 0);
+        int x_end = std::min({ src.x + src.width, src.x + img.get_width(), m_width });
+
+        for (int y = y_begin; y < y_end; ++y)
+        {
+            // Contiguous rows of one channel each, the loop is vectorized
+            const Color* row = img.get_row(y - src.y);
+            size_t offset = (size_t)(y - strip_y) * m_width;
+            float* r = m_strip.r.data() + offset;
+            float* g = m_strip.g.data() + offset;
+            float* b = m_strip.b.data() + offset;
+            uint16_t* n = m_strip.n.data() + offset;
+
+            for (int x = x_begin; x < x_end; ++x)
+            {
+                r[x] += row[x - src.x].r;
+                g[x] += row[x - src.x].g;
+                b[x] += row[x - src.x].b;
+                n[x] += 1;
+            }
+        }
+    }
+
+    void Compositor::accumulate(const Image& img, const Source& src, MappedCanvas& canvas, int y0, int y1)
+    {
+        int y_begin = std::max({ src.y, y0, 0 });
+        int y_end = std::min({ src.y + src.height, src.y + img.get_height(), y1, m_height });
+
+        int x_begin = std::max(src.x, 0);
+        int x_end = std::min({ src.x + src.width, src.x + img.get_width(), m_width });
+
+        if (x_end <= x_begin)
+            return;
+
+        for (int y = y_begin; y < y_end; ++y)
+        {
+            const Color* row = img.get_row(y - src.y);
+
+            for (int tile_x = x_begin / MappedCanvas::TILE_SIZE; tile_x <= (x_end - 1) / MappedCanvas::TILE_SIZE; ++tile_x)
+            {
+                int tile_x0 = tile_x * MappedCanvas::TILE_SIZE;
+                auto span = canvas.get_span(tile_x, y);
+
+                for (int x = std::max(x_begin, tile_x0); x < std::min(x_end, tile_x0 + MappedCanvas::TILE_SIZE); ++x)
+                {
+                    span.r[x - tile_x0] += row[x - src.x].r;
+                    span.g[x - tile_x0] += row[x - src.x].g;
+                    span.b[x - tile_x0] += row[x - src.x].b;
+                    span.n[x - tile_x0] += 1;
+                }
+            }
+        }
+    }
+
+    void Compositor::resolve_rows(int row0, int row1, uint8_t* dst) const
+    {
+        for (size_t i = (size_t)row0 * m_width; i < (size_t)row1 * m_width; ++i)
+            dst = quantize(m_strip.r[i], m_strip.g[i], m_strip.b[i], m_strip.n[i], dst);
+    }
+
+    void Compositor::resolve_row(const MappedCanvas& canvas, int y, uint8_t* dst) const
+    {
+        for (int tile_x = 0; tile_x < canvas.get_n_tiles_x(); ++tile_x)
+        {
+            auto span = canvas.get_span(tile_x, y);
+            int n_pixels = std::min(MappedCanvas::TILE_SIZE, m_width - tile_x * MappedCanvas::TILE_SIZE);
+
+            for (int i = 0; i < n_pixels; ++i)
+                dst = quantize(span.r[i], span.g[i], span.b[i], span.n[i], dst);
+        }
+    }
+
+    uint8_t* Compositor::quantize(float r, float g, float b, uint16_t n, uint8_t* dst) const
+    {
+        float max_value = m_bit_depth == 16 ? 65535.0f : 255.0f;
+        float scale = n > 0 ? max_value / n : 0.0f;
+
+        float values[3] = {
+            std::clamp(r * scale, 0.0f, max_value) + 0.5f,
+            std::clamp(g * scale, 0.0f, max_value) + 0.5f,
+            std::clamp(b * scale, 0.0f, max_value) + 0.5f
+        };
+
+        if (m_bit_depth == 16)
+        {
+            // PPM samples are big-endian
+            for (float value : values)
+            {
+                auto sample = (uint16_t)value;
+                *dst++ = (uint8_t)(sample >> 8);
+                *dst++ = (uint8_t)(sample & 0xFF);
+            }
+        }
+        else
+        {
+            for (float value : values)
+                *dst++ = (uint8_t)value;
+        }
+
+        return dst;
+    }
+
+    void Compositor::report_progress(Progress& progress, int n_rows, bool force) const
+    {
+        auto t_now = std::chrono::steady_clock::now();
+        if (t_now - progress.t_last_report < std::chrono::seconds(1) && !force)
+            return;
+
+        progress.t_last_report = t_now;
+
+        size_t row_size = (size_t)m_width * get_output_bytes_per_pixel();
+        float seconds = std::chrono::duration<float>(t_now - progress.t_start).count();
+        float mpixels = (float)n_rows * m_width / 1e6f;
+        float eta = n_rows > 0 ? seconds * (m_height - n_rows) / n_rows : 0.0f;
+
+        printf("\e[0E\e[K[%d/%d rows, %.0f%%] %.1f MPixel/s, %.1f MiB/s written, %lu sources loaded, ETA %.0f s",
+            n_rows, m_height, 100.0f * n_rows / m_height,
+            mpixels / std::max(seconds, 1e-3f), n_rows * row_size / std::max(seconds, 1e-3f) / (1 << 20), progress.n_loaded, eta);
+
+        if (n_rows == m_height)
+            printf("\nComposited %.1f MPixel from %lu sources in %.1f s\n", (float)m_width * m_height / 1e6f, progress.n_loaded, seconds);
+
+        fflush(stdout);
+    }
+}
@@ -83,41 +83,125 @@ namespace ns
         return m_state;
     }
 
-    void Events::push(const Event* pEvent)
-    {
-        std::unique_lock lock(m_queue_mtx);
+    Event::Event()
+        : m_type(EventType::None), m_none(0)
+    {}
 
-        m_queue.push(pEvent);
-        m_queue_cv.notify_one();
+    Event::Event(const MouseMoveEvent& event)
+        : m_type(EventType::MouseMove), m_mouse_move(event)
+    {}
+
+    Event::Event(const MouseButtonEvent& event)
+        : m_type(EventType::MouseButton), m_mouse_button(event)
+    {}
+
+    Event::Event(const KeyboardEvent& event)
+        : m_type(EventType::Keyboard), m_keyboard(event)
+    {}
+
+    EventType Event::get_type() const
+    {
+        return m_type;
     }
 
-    std::unique_ptr<const Event> Events::pop()
+    bool Events::push(const Event& event)
     {
-        std::unique_lock lock(m_queue_mtx);
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        size_t capacity = event.get_type() == EventType::MouseMove ? MOUSE_MOVE_CAPACITY : CAPACITY;
 
-        m_queue_cv.wait(lock, [&]{ return !m_queue.empty(); });
+        if (tail - m_head.load(std::memory_order_acquire) >= capacity)
+            return false;
 
-        return pop_internal(lock);
+        m_ring[tail % CAPACITY] = event;
+        m_tail.store(tail + 1, std::memory_order_seq_cst);
+
+        notify_consumer();
+
+        return true;
     }
 
-    std::optional<std::unique_ptr<const Event>> Events::try_pop()
+    Event Events::pop()
     {
-        std::unique_lock lock(m_queue_mtx);
+        if (is_empty())
+        {
+            std::unique_lock lock(m_wait_mtx);
+
+            m_consumer_waiting.store(true, std::memory_order_seq_cst);
+            m_wait_cv.wait(lock, [&]{ return !is_empty(); });
+            m_consumer_waiting.store(false, std::memory_order_relaxed);
+        }
+
+        return pop_internal();
+    }
 
-        if (m_queue.empty())
+    std::optional<Event> Events::try_pop()
+    {
+        if (is_empty())
             return {};
 
-        return pop_internal(lock);
+        return pop_internal();
+    }
+
+    void Events::wait()
+    {
+        if (!is_ready())
+        {
+            std::unique_lock lock(m_wait_mtx);
+
+            m_consumer_waiting.store(true, std::memory_order_seq_cst);
+            m_wait_cv.wait(lock, [&]{ return is_ready(); });
+            m_consumer_waiting.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    void Events::wake()
+    {
+        m_wake_pending.store(true, std::memory_order_seq_cst);
+
+        notify_consumer();
+    }
+
+    Event Events::pop_internal()
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        size_t tail = m_tail.load(std::memory_order_acquire);
+
+        assert(head != tail && "Events::pop_internal requires a non-empty ring");
+
+        Event event = m_ring[head % CAPACITY];
+        ++head;
+
+        // Merge consecutive mouse moves into the latest one
+        while (event.get_type() == EventType::MouseMove && head != tail &&
+               m_ring[head % CAPACITY].get_type() == EventType::MouseMove)
+        {
+            event = m_ring[head % CAPACITY];
+            ++head;
+        }
+
+        m_head.store(head, std::memory_order_release);
+
+        return event;
     }
 
-    std::unique_ptr<const Event> Events::pop_internal(std::unique_lock<std::mutex>& lock)
+    bool Events::is_empty() const
     {
-        (void)lock;
-        assert(lock.owns_lock() && "Lock must be owned inside Events::pop_internal");
+        return m_head.load(std::memory_order_relaxed) == m_tail.load(std::memory_order_seq_cst);
+    }
 
-        std::unique_ptr<const Event> ptr;
-        ptr.reset(m_queue.front());
-        m_queue.pop();
-        return ptr;
+    // Consumes a pending wake
+    bool Events::is_ready()
+    {
+        return m_wake_pending.exchange(false, std::memory_order_seq_cst) || !is_empty();
+    }
+
+    void Events::notify_consumer()
+    {
+        // Pairs with the store in pop()/wait(), either the consumer sees the new state or it is notified
+        if (m_consumer_waiting.load(std::memory_order_seq_cst))
+        {
+            std::lock_guard lock(m_wait_mtx);
+            m_wait_cv.notify_one();
+        }
     }
-}
\ No newline at end of file
+}
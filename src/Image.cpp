@@ -2,14 +2,15 @@
 
 #include <stdexcept>
 #include <cassert>
+#include <algorithm>
+#include <memory>
 
 #include "vendor/stb_image.h"
 #include "vendor/stb_image_write.h"
 
 namespace ns
 {
-    std::mutex Image::s_tex_objs_to_delete_mtx;
-    std::queue<GLuint> Image::s_tex_objs_to_delete;
+    TexturePool Image::s_texture_pool;
 
     Image::Image()
         : Image(1, 1, false)
@@ -17,23 +18,33 @@ namespace ns
 
     Image::Image(int width, int height, bool make_viewable)
         : m_width(width), m_height(height),
-          m_pixels(width * height, Color()), m_pixels_mtx(),
+          m_p_pixels(std::make_shared<PixelBuffer>((size_t)width * height)),
+          m_offset(0), m_stride(width), m_pixels_mtx(),
           m_has_unpushed_changes(true),
+          m_dirty_x0(0), m_dirty_y0(0), m_dirty_x1(width), m_dirty_y1(height),
+          m_texture_level(NO_TEXTURE_LEVEL),
+          m_pending_texture_level(NO_TEXTURE_LEVEL),
+          m_texture_format(TextureFormat::RGBA8),
           m_make_viewable(make_viewable),
-          m_textureObject(0)
+          m_texture({ 0, 0, 0, 0 }),
+          m_pending_texture({ 0, 0, 0, 0 })
     {
-        gen_gl_data();
+        std::uninitialized_fill(m_p_pixels->data(), m_p_pixels->data() + m_p_pixels->size(), Color());
     }
 
     Image::Image(const Image& other)
         : m_width(other.m_width), m_height(other.m_height),
-          m_pixels(other.m_pixels), m_pixels_mtx(),
+          m_p_pixels(other.share_pixels()),
+          m_offset(other.m_offset), m_stride(other.m_stride), m_pixels_mtx(),
           m_has_unpushed_changes(true),
+          m_dirty_x0(0), m_dirty_y0(0), m_dirty_x1(other.m_width), m_dirty_y1(other.m_height),
+          m_texture_level(NO_TEXTURE_LEVEL),
+          m_pending_texture_level(NO_TEXTURE_LEVEL),
+          m_texture_format(other.m_texture_format),
           m_make_viewable(other.m_make_viewable),
-          m_textureObject(0)
-    {
-        gen_gl_data();
-    }
+          m_texture({ 0, 0, 0, 0 }),
+          m_pending_texture({ 0, 0, 0, 0 })
+    {}
 
     Image::Image(Image&& other)
         : Image()
@@ -48,17 +59,37 @@ namespace ns
 
     Image& Image::operator=(const Image& other)
     {
-        clear_gl_data();
-        
+        // A texture of the same size is overwritten by the next upload instead of being reallocated.
+        // It still shows the previous pixels, so it is only drawn again once that upload is complete.
+        if (m_width != other.m_width || m_height != other.m_height || m_texture_format != other.m_texture_format || !other.m_make_viewable)
+        {
+            clear_gl_data();
+        }
+        else if (m_texture.id)
+        {
+            if (m_pending_texture.id)
+            {
+                s_texture_pool.release(m_texture);
+            }
+            else
+            {
+                m_pending_texture = m_texture;
+                m_pending_texture_level = m_texture_level;
+            }
+
+            m_texture = { 0, 0, 0, 0 };
+            m_texture_level = NO_TEXTURE_LEVEL;
+        }
+
         m_width = other.m_width;
         m_height = other.m_height;
-        m_pixels = other.m_pixels;
-        //m_pixels_mtx = other.m_pixels_mtx;
-        m_has_unpushed_changes = true;
+        m_p_pixels = other.share_pixels();
+        m_offset = other.m_offset;
+        m_stride = other.m_stride;
+        m_has_unpushed_changes = false;
+        mark_dirty(0, 0, m_width, m_height);
+        m_texture_format = other.m_texture_format;
         m_make_viewable = other.m_make_viewable;
-        //m_textureObject = other.m_textureObject;
-
-        gen_gl_data();
 
         return *this;
     }
@@ -67,11 +98,20 @@ namespace ns
     {
         std::swap(m_width, other.m_width);
         std::swap(m_height, other.m_height);
-        std::swap(m_pixels, other.m_pixels);
-        //std::swap(m_pixels_mtx, other.m_pixels_mtx);
+        std::swap(m_p_pixels, other.m_p_pixels);
+        std::swap(m_offset, other.m_offset);
+        std::swap(m_stride, other.m_stride);
         std::swap(m_has_unpushed_changes, other.m_has_unpushed_changes);
+        std::swap(m_dirty_x0, other.m_dirty_x0);
+        std::swap(m_dirty_y0, other.m_dirty_y0);
+        std::swap(m_dirty_x1, other.m_dirty_x1);
+        std::swap(m_dirty_y1, other.m_dirty_y1);
+        std::swap(m_texture_level, other.m_texture_level);
+        std::swap(m_pending_texture_level, other.m_pending_texture_level);
+        std::swap(m_texture_format, other.m_texture_format);
         std::swap(m_make_viewable, other.m_make_viewable);
-        std::swap(m_textureObject, other.m_textureObject);
+        std::swap(m_texture, other.m_texture);
+        std::swap(m_pending_texture, other.m_pending_texture);
 
         return *this;
     }
@@ -80,23 +120,152 @@ namespace ns
     {
         std::lock_guard lock(m_pixels_mtx);
 
-        m_pixels[pos_to_index(x, y)] = c;
-        m_has_unpushed_changes = true;
+        make_unique();
+        (*m_p_pixels)[pos_to_index(x, y)] = c;
+        mark_dirty(x, y, x + 1, y + 1);
     }
 
-    void Image::push_changes() const
+    Color* Image::get_mutable_row(int y)
     {
-        if (!m_has_unpushed_changes || !m_make_viewable)
-            return;
+        std::lock_guard lock(m_pixels_mtx);
+
+        make_unique();
+        mark_dirty(0, y, m_width, y + 1);
 
+        return m_p_pixels->data() + pos_to_index(0, y);
+    }
+
+    Image Image::crop(int x, int y, int width, int height) const
+    {
+        assert(x >= 0 && y >= 0 && x + width <= m_width && y + height <= m_height && "Crop outside of the image");
+
+        Image img;
+        img.m_width = width;
+        img.m_height = height;
+        img.m_p_pixels = share_pixels();
+        img.m_offset = pos_to_index(x, y);
+        img.m_stride = m_stride;
+        img.mark_dirty(0, 0, width, height);
+        img.m_texture_format = m_texture_format;
+
+        return img;
+    }
+
+    bool Image::push_changes(int level, TextureUploader* p_uploader) const
+    {
         std::lock_guard lock(m_pixels_mtx);
 
-        bind();
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, m_width, m_height, 0, GL_RGBA, GL_FLOAT, m_pixels.data());
+        if (!m_make_viewable)
+            return true;
+
+        // Uploads go to the pending texture while there is one
+        int target_level = m_pending_texture.id ? m_pending_texture_level : m_texture_level;
+
+        bool needs_storage = level < target_level;
+        if (!m_has_unpushed_changes && !needs_storage)
+            return true;
+
+        GLenum internal_format = m_texture_format == TextureFormat::RGBA8 ? GL_RGBA8 : GL_RGB16F;
+        GLenum format = m_texture_format == TextureFormat::RGBA8 ? GL_RGBA : GL_RGB;
+        GLenum type = m_texture_format == TextureFormat::RGBA8 ? GL_UNSIGNED_BYTE : GL_FLOAT;
+
+        // The drawn texture stays in use until the new level has been uploaded completely
+        if (needs_storage)
+        {
+            int factor = 1 << level;
+
+            if (m_pending_texture.id)
+                s_texture_pool.release(m_pending_texture);
+            m_pending_texture = s_texture_pool.acquire((m_width + factor - 1) / factor, (m_height + factor - 1) / factor, internal_format, format, type);
+
+            m_pending_texture_level = level;
+            target_level = level;
+            mark_dirty(0, 0, m_width, m_height);
+        }
+
+        const PooledTexture& target = m_pending_texture.id ? m_pending_texture : m_texture;
+
+        // Changed region in texels of the storage level
+        int factor = 1 << target_level;
+        int x0 = m_dirty_x0 / factor;
+        int y0 = m_dirty_y0 / factor;
+        int x1 = (m_dirty_x1 + factor - 1) / factor;
+        int y1 = (m_dirty_y1 + factor - 1) / factor;
+
+        int width = x1 - x0;
+        size_t row_size = width * get_texel_size();
+
+        // Uploads as many rows as the budget allows, at least one per frame
+        int height = y1 - y0;
+        if (p_uploader)
+        {
+            height = std::min<size_t>(height, p_uploader->get_budget_left() / row_size);
+            if (height == 0 && p_uploader->is_budget_untouched())
+                height = 1;
+
+            if (height == 0)
+            {
+                p_uploader->defer();
+                return false;
+            }
+
+            p_uploader->upload(
+                target.id, x0, y0, width, height, format, type, row_size * height,
+                [&](void* dst) { write_texels(target_level, x0, y0, width, height, dst); }
+            );
+        }
+        else
+        {
+            std::vector<unsigned char> texels(row_size * height);
+            write_texels(target_level, x0, y0, width, height, texels.data());
+
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(GL_TEXTURE_2D, target.id);
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, x0, y0, width, height, format, type, texels.data());
+        }
 
         assert(glGetError() == GL_NO_ERROR);
 
+        if (y0 + height < y1)
+        {
+            m_dirty_y0 = (y0 + height) * factor;
+            if (p_uploader)
+                p_uploader->defer();
+            return false;
+        }
+
         m_has_unpushed_changes = false;
+
+        if (m_pending_texture.id)
+        {
+            if (m_texture.id)
+                s_texture_pool.release(m_texture);
+
+            m_texture = m_pending_texture;
+            m_texture_level = m_pending_texture_level;
+            m_pending_texture = { 0, 0, 0, 0 };
+            m_pending_texture_level = NO_TEXTURE_LEVEL;
+        }
+
+        return true;
+    }
+
+    void Image::set_texture_format(TextureFormat format)
+    {
+        std::lock_guard lock(m_pixels_mtx);
+
+        if (format == m_texture_format)
+            return;
+
+        // Storage is reallocated with the next upload, the old texture is drawn until then
+        if (m_pending_texture.id)
+            s_texture_pool.release(m_pending_texture);
+
+        m_texture_format = format;
+        m_texture_level = NO_TEXTURE_LEVEL;
+        m_pending_texture = { 0, 0, 0, 0 };
+        m_pending_texture_level = NO_TEXTURE_LEVEL;
     }
 
     int Image::get_width() const
@@ -109,20 +278,53 @@ namespace ns
         return m_height;
     }
 
+    void Image::make_viewable() const
+    {
+        std::lock_guard lock(m_pixels_mtx);
+
+        m_make_viewable = true;
+    }
+
     bool Image::is_viewable() const
     {
+        std::lock_guard lock(m_pixels_mtx);
+
         return m_make_viewable;
     }
 
+    int Image::get_texture_level() const
+    {
+        return m_texture_level;
+    }
+
     const Color& Image::get_pixel(int x, int y) const
     {
-        return m_pixels[pos_to_index(x, y)];
+        return (*m_p_pixels)[pos_to_index(x, y)];
+    }
+
+    const Color* Image::get_row(int y) const
+    {
+        return m_p_pixels->data() + pos_to_index(0, y);
+    }
+
+    bool Image::shares_pixels_with(const Image& other) const
+    {
+        return m_p_pixels == other.m_p_pixels;
     }
 
     void Image::bind() const
     {
+        // The texture is created with the first upload
+        if (!m_texture.id)
+            push_changes();
+
         glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, m_textureObject);
+        glBindTexture(GL_TEXTURE_2D, m_texture.id);
+    }
+
+    GLuint Image::get_texture() const
+    {
+        return m_texture.id;
     }
 
     Image Image::load_from_file(const std::string& filepath, bool make_viewable, std::function<Color (Color, float, float)> filter)
@@ -134,22 +336,25 @@ namespace ns
 
         Image img(width, height, make_viewable);
 
-        for (int i = 0; i < width * height; ++i)
+        for (int y = 0; y < height; ++y)
         {
-            unsigned char* pixel = data + i * 4;
+            Color* row = img.get_mutable_row(y);
 
-            Color c;
-            c.r = pixel[0] / 255.0f;
-            c.g = pixel[1] / 255.0f;
-            c.b = pixel[2] / 255.0f;
-            c.a = pixel[3] / 255.0f;
+            for (int x = 0; x < width; ++x)
+            {
+                unsigned char* pixel = data + (x + y * width) * 4;
 
-            int x = (i % width);
-            int y = (i / width);
-            float u = x / (float)width;
-            float v = y / (float)height;
+                Color c;
+                c.r = pixel[0] / 255.0f;
+                c.g = pixel[1] / 255.0f;
+                c.b = pixel[2] / 255.0f;
+                c.a = pixel[3] / 255.0f;
 
-            img.put_pixel(filter(c, u, v), x, y);
+                float u = x / (float)width;
+                float v = y / (float)height;
+
+                row[x] = filter(c, u, v);
+            }
         }
 
         stbi_image_free(data);
@@ -157,13 +362,19 @@ namespace ns
         return img;
     }
 
+    bool Image::can_load_from_file(const std::string& filepath)
+    {
+        int width, height, channels_in_file;
+        return stbi_info(filepath.c_str(), &width, &height, &channels_in_file) != 0;
+    }
+
     bool Image::save_to_file(const std::string& filepath) const
     {
         std::vector<unsigned char> data(m_width * m_height * 3);
 
         for (int i = 0; i < m_width * m_height; ++i)
         {
-            auto& c = m_pixels[i];
+            auto& c = get_pixel(i % m_width, i / m_width);
             data[i * 3 + 0] = c.r * 255;
             data[i * 3 + 1] = c.g * 255;
             data[i * 3 + 2] = c.b * 255;
@@ -176,38 +387,126 @@ namespace ns
 
     void Image::delete_pending_tex_objs()
     {
-        std::lock_guard lock(s_tex_objs_to_delete_mtx);
+        s_texture_pool.collect();
+    }
 
-        while (!s_tex_objs_to_delete.empty())
-        {
-            GLuint tex_obj = s_tex_objs_to_delete.front();
-            s_tex_objs_to_delete.pop();
-            glDeleteTextures(1, &tex_obj);
-        }
+    TexturePool& Image::get_texture_pool()
+    {
+        return s_texture_pool;
     }
 
     int Image::pos_to_index(int x, int y) const
     {
-        return x + y * m_width;
+        return m_offset + x + y * m_stride;
     }
 
-    void Image::gen_gl_data()
+    std::shared_ptr<PixelBuffer> Image::share_pixels() const
     {
-        if (!m_make_viewable)
+        std::lock_guard lock(m_pixels_mtx);
+
+        return m_p_pixels;
+    }
+
+    void Image::make_unique()
+    {
+        // Views of a larger buffer are compacted as well, so the rest of the buffer can be freed
+        bool is_view = m_offset != 0 || m_stride != m_width || m_p_pixels->size() != (size_t)m_width * m_height;
+        if (m_p_pixels.use_count() == 1 && !is_view)
             return;
 
-        glGenTextures(1, &m_textureObject);
-        glBindTexture(GL_TEXTURE_2D, m_textureObject);
+        auto p_pixels = std::make_shared<PixelBuffer>((size_t)m_width * m_height);
+        for (int y = 0; y < m_height; ++y)
+        {
+            auto* row = m_p_pixels->data() + pos_to_index(0, y);
+            std::uninitialized_copy(row, row + m_width, p_pixels->data() + (size_t)y * m_width);
+        }
 
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, m_width, m_height, 0, GL_RGBA, GL_FLOAT, NULL);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        m_p_pixels = std::move(p_pixels);
+        m_offset = 0;
+        m_stride = m_width;
     }
 
-    void Image::clear_gl_data()
+    void Image::mark_dirty(int x0, int y0, int x1, int y1) const
     {
-        if (!m_textureObject)
+        if (!m_has_unpushed_changes)
+        {
+            m_dirty_x0 = x0;
+            m_dirty_y0 = y0;
+            m_dirty_x1 = x1;
+            m_dirty_y1 = y1;
+            m_has_unpushed_changes = true;
             return;
-        m_textureObject = 0;
+        }
+
+        m_dirty_x0 = std::min(m_dirty_x0, x0);
+        m_dirty_y0 = std::min(m_dirty_y0, y0);
+        m_dirty_x1 = std::max(m_dirty_x1, x1);
+        m_dirty_y1 = std::max(m_dirty_y1, y1);
+    }
+
+    size_t Image::get_texel_size() const
+    {
+        return m_texture_format == TextureFormat::RGBA8 ? 4 : 3 * sizeof(float);
+    }
+
+    void Image::write_texels(int level, int x0, int y0, int width, int height, void* dst) const
+    {
+        int factor = 1 << level;
+
+        auto* dst_rgba8 = static_cast<unsigned char*>(dst);
+        auto* dst_rgb32f = static_cast<float*>(dst);
+
+        for (int y = y0; y < y0 + height; ++y)
+        {
+            for (int x = x0; x < x0 + width; ++x)
+            {
+                // Box filter, partial blocks at the right and bottom edges average fewer pixels
+                Color c = { 0.0f, 0.0f, 0.0f, 0.0f };
+                int n = 0;
+
+                for (int sy = y * factor; sy < std::min((y + 1) * factor, m_height); ++sy)
+                {
+                    for (int sx = x * factor; sx < std::min((x + 1) * factor, m_width); ++sx)
+                    {
+                        auto& p = (*m_p_pixels)[pos_to_index(sx, sy)];
+                        c.r += p.r;
+                        c.g += p.g;
+                        c.b += p.b;
+                        c.a += p.a;
+                        ++n;
+                    }
+                }
+
+                c = { c.r / n, c.g / n, c.b / n, c.a / n };
+
+                if (m_texture_format == TextureFormat::RGBA8)
+                {
+                    *dst_rgba8++ = (unsigned char)(std::clamp(c.r, 0.0f, 1.0f) * 255.0f + 0.5f);
+                    *dst_rgba8++ = (unsigned char)(std::clamp(c.g, 0.0f, 1.0f) * 255.0f + 0.5f);
+                    *dst_rgba8++ = (unsigned char)(std::clamp(c.b, 0.0f, 1.0f) * 255.0f + 0.5f);
+                    *dst_rgba8++ = (unsigned char)(std::clamp(c.a, 0.0f, 1.0f) * 255.0f + 0.5f);
+                }
+                else
+                {
+                    *dst_rgb32f++ = c.r;
+                    *dst_rgb32f++ = c.g;
+                    *dst_rgb32f++ = c.b;
+                }
+            }
+        }
+    }
+
+    void Image::clear_gl_data()
+    {
+        // Textures are only deleted or reused by the render thread
+        if (m_texture.id)
+            s_texture_pool.release(m_texture);
+        if (m_pending_texture.id)
+            s_texture_pool.release(m_pending_texture);
+
+        m_texture = { 0, 0, 0, 0 };
+        m_texture_level = NO_TEXTURE_LEVEL;
+        m_pending_texture = { 0, 0, 0, 0 };
+        m_pending_texture_level = NO_TEXTURE_LEVEL;
     }
 }
\ No newline at end of file
@@ -0,0 +1,146 @@
+#include "ImageGrid.h"
+
+#include <stdexcept>
+#include <algorithm>
+
+namespace ns
+{
+    bool operator==(const ImageID& iid1, const ImageID& iid2)
+    {
+        return iid1.x == iid2.x && iid1.y == iid2.y;
+    }
+
+    bool operator<(const ImageID& iid1, const ImageID& iid2)
+    {
+        if (iid1.x == iid2.x)
+            return iid1.y < iid2.y;
+        return iid1.x < iid2.x;
+    }
+
+    ImageInfoRef::operator ImageInfo() const
+    {
+        return { pos_x, pos_y, width, height, has_been_adjusted, ignore };
+    }
+
+    ImageGrid::ImageGrid()
+        : ImageGrid(0, 0)
+    {}
+
+    ImageGrid::ImageGrid(int size_x, int size_y)
+        : m_size_x(size_x), m_size_y(size_y),
+          m_is_sparse(false),
+          m_pos_x(size_x * size_y, 0), m_pos_y(size_x * size_y, 0),
+          m_width(size_x * size_y, 0), m_height(size_x * size_y, 0),
+          m_flags(size_x * size_y, Flags{ false, false })
+    {}
+
+    ImageGrid::ImageGrid(int size_x, int size_y, std::vector<ImageID> ids)
+        : m_size_x(size_x), m_size_y(size_y),
+          m_is_sparse(true)
+    {
+        std::sort(ids.begin(), ids.end());
+        ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+
+        m_ids = std::move(ids);
+
+        m_slots.reserve(m_ids.size());
+        for (size_t slot = 0; slot < m_ids.size(); ++slot)
+            m_slots.insert({ get_hash_key(m_ids[slot]), slot });
+
+        m_pos_x.resize(m_ids.size(), 0);
+        m_pos_y.resize(m_ids.size(), 0);
+        m_width.resize(m_ids.size(), 0);
+        m_height.resize(m_ids.size(), 0);
+        m_flags.resize(m_ids.size(), Flags{ false, false });
+    }
+
+    int ImageGrid::get_size_x() const
+    {
+        return m_size_x;
+    }
+
+    int ImageGrid::get_size_y() const
+    {
+        return m_size_y;
+    }
+
+    size_t ImageGrid::size() const
+    {
+        return m_flags.size();
+    }
+
+    bool ImageGrid::is_sparse() const
+    {
+        return m_is_sparse;
+    }
+
+    bool ImageGrid::contains(const ImageID& img_id) const
+    {
+        return find(img_id) != npos;
+    }
+
+    size_t ImageGrid::find(const ImageID& img_id) const
+    {
+        if (img_id.x < 0 || img_id.x >= m_size_x || img_id.y < 0 || img_id.y >= m_size_y)
+            return npos;
+
+        if (!m_is_sparse)
+            return (size_t)img_id.x * m_size_y + img_id.y;
+
+        auto it = m_slots.find(get_hash_key(img_id));
+        return it != m_slots.end() ? it->second : npos;
+    }
+
+    ImageID ImageGrid::get_id(size_t slot) const
+    {
+        if (m_is_sparse)
+            return m_ids[slot];
+
+        return { (int)(slot / m_size_y), (int)(slot % m_size_y) };
+    }
+
+    ImageInfoRef ImageGrid::operator[](const ImageID& img_id)
+    {
+        size_t slot = find(img_id);
+        if (slot == npos)
+            throw std::out_of_range("Image ID is not part of the grid");
+
+        return at_slot(slot);
+    }
+
+    ImageInfoRef ImageGrid::at_slot(size_t slot)
+    {
+        auto& flags = m_flags[slot];
+        return { m_pos_x[slot], m_pos_y[slot], m_width[slot], m_height[slot], flags.has_been_adjusted, flags.ignore };
+    }
+
+    ImageInfo ImageGrid::get_info(size_t slot) const
+    {
+        auto& flags = m_flags[slot];
+        return { m_pos_x[slot], m_pos_y[slot], m_width[slot], m_height[slot], flags.has_been_adjusted, flags.ignore };
+    }
+
+    void ImageGrid::set_info(size_t slot, const ImageInfo& img_info)
+    {
+        m_pos_x[slot] = img_info.pos_x;
+        m_pos_y[slot] = img_info.pos_y;
+        m_width[slot] = img_info.width;
+        m_height[slot] = img_info.height;
+        m_flags[slot] = { img_info.has_been_adjusted, img_info.ignore };
+    }
+
+    const std::vector<int>& ImageGrid::get_pos_x() const
+    {
+        return m_pos_x;
+    }
+
+    const std::vector<int>& ImageGrid::get_pos_y() const
+    {
+        return m_pos_y;
+    }
+
+    uint64_t ImageGrid::get_hash_key(const ImageID& img_id)
+    {
+        return ((uint64_t)(uint32_t)img_id.x << 32) | (uint32_t)img_id.y;
+    }
+}
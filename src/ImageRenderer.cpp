@@ -1,6 +1,8 @@
 #include "ImageRenderer.h"
 
 #include <cstring>
+#include <cmath>
+#include <algorithm>
 
 #include "Vertex.h"
 
@@ -10,21 +12,29 @@ const char* vertex_shader_src_str = R"(
 
 layout (location = 0) in vec2 Position;
 layout (location = 1) in vec2 TexCoord;
+layout (location = 2) in vec4 ImageRect;
+layout (location = 3) in float ImageOpacity;
+layout (location = 4) in vec4 ImageBorder;
+layout (location = 5) in vec4 ImageUV;
 
 uniform vec3 Camera;
-uniform vec2 ImageDimensions;
-uniform vec2 ImagePosition;
 
 out vec2 TexCoord0;
+out vec2 QuadCoord0;
+out float Opacity;
+out vec4 Border;
 
 void main()
 {
-    vec2 ScaledPosition = Position * ImageDimensions;
-    vec2 MovedPosition = ScaledPosition + ImagePosition + Camera.xy;
+    vec2 ScaledPosition = Position * ImageRect.zw;
+    vec2 MovedPosition = ScaledPosition + ImageRect.xy + Camera.xy;
     vec2 ZoomedPosition = MovedPosition * Camera.z;
     ZoomedPosition.y *= -1.0;
     gl_Position = vec4(ZoomedPosition, 0.0, 1.0);
-    TexCoord0 = TexCoord;
+    TexCoord0 = ImageUV.xy + TexCoord * ImageUV.zw;
+    QuadCoord0 = TexCoord;
+    Opacity = ImageOpacity;
+    Border = ImageBorder;
 };
 
 )";
@@ -34,25 +44,28 @@ const char *fragment_shader_src_str = R"(
 #version 330
 
 in vec2 TexCoord0;
+in vec2 QuadCoord0;
+in float Opacity;
+in vec4 Border;
 
 out vec4 FragColor;
 
 uniform sampler2D gSampler;
-
-uniform float Opacity;
-uniform float HasBorder;
-uniform vec3  BorderColor;
+uniform float HasTexture;
 
 void main()
 {
-    if (HasBorder > 0.5 && 
-        (TexCoord0.x < 0.01 || TexCoord0.x > 0.99 || TexCoord0.y < 0.01 || TexCoord0.y > 0.99))
+    if (Border.a > 0.5 && 
+        (QuadCoord0.x < 0.01 || QuadCoord0.x > 0.99 || QuadCoord0.y < 0.01 || QuadCoord0.y > 0.99))
     {
-        FragColor = vec4(BorderColor, 0.5);
+        FragColor = vec4(Border.rgb, 0.5);
     }
     else
     {
-        vec3 BaseColor = texture2D(gSampler, TexCoord0.xy).rgb;
+        if (HasTexture < 0.5 || Opacity <= 0.0)
+            discard;
+
+        vec3 BaseColor = texture(gSampler, TexCoord0.xy).rgb;
         FragColor = vec4(BaseColor, Opacity);
     }
     
@@ -64,50 +77,196 @@ void main()
 namespace ns
 {
     ImageRenderer::ImageRenderer()
+        : m_camera({ 0.0f, 0.0f, 1.0f }),
+          m_viewport_width(1), m_viewport_height(1),
+          m_batch_texture(0),
+          m_n_draw_calls(0), m_n_culled(0)
     {
         generate_vertex_buffer();
         load_shader_program();
+        generate_vertex_array();
+
+        m_u_camera = glGetUniformLocation(m_shader_prog, "Camera");
+        m_u_sampler = glGetUniformLocation(m_shader_prog, "gSampler");
+        m_u_has_texture = glGetUniformLocation(m_shader_prog, "HasTexture");
+    }
+
+    void ImageRenderer::begin(const Camera& cam)
+    {
+        m_camera = cam;
+        m_batch.clear();
+        m_batch_texture = 0;
+        m_n_draw_calls = 0;
+        m_n_culled = 0;
+        m_uploader.begin_frame();
+
+        GLint viewport[4];
+        glGetIntegerv(GL_VIEWPORT, viewport);
+        m_viewport_width = std::max(1, viewport[2]);
+        m_viewport_height = std::max(1, viewport[3]);
+    }
+
+    void ImageRenderer::add(const Image& img, int x, int y, float opacity, bool has_border, Color border_color)
+    {
+        // Off-screen images are neither drawn nor uploaded
+        if (!is_visible(x, y, img.get_width(), img.get_height()))
+        {
+            ++m_n_culled;
+            return;
+        }
+
+        // Until the upload of a new level is complete the previous texture is drawn, or only the border without one
+        img.push_changes(get_texture_level(img.get_width(), img.get_height()), &m_uploader);
+
+        Instance instance = {
+            { (float)x, (float)y, (float)img.get_width(), (float)img.get_height() },
+            { 0.0f, 0.0f, 1.0f, 1.0f },
+            opacity,
+            { border_color.r, border_color.g, border_color.b, has_border ? 1.0f : 0.0f }
+        };
+
+        add_instance(img.get_texture(), instance);
+    }
+
+    void ImageRenderer::add_region(const Image& img, const float uv[4], int x, int y, int width, int height, float opacity)
+    {
+        if (!is_visible(x, y, width, height))
+        {
+            ++m_n_culled;
+            return;
+        }
+
+        // The whole image shares one texture, its level follows the size the whole image would have on screen
+        int level = get_texture_level(img.get_width(), img.get_height(), width / uv[2], height / uv[3]);
+        img.push_changes(level, &m_uploader);
+
+        Instance instance = {
+            { (float)x, (float)y, (float)width, (float)height },
+            { uv[0], uv[1], uv[2], uv[3] },
+            opacity,
+            { 0.0f, 0.0f, 0.0f, 0.0f }
+        };
+
+        add_instance(img.get_texture(), instance);
+    }
+
+    void ImageRenderer::add_border(int x, int y, int width, int height, Color border_color)
+    {
+        if (!is_visible(x, y, width, height))
+        {
+            ++m_n_culled;
+            return;
+        }
+
+        Instance instance = {
+            { (float)x, (float)y, (float)width, (float)height },
+            { 0.0f, 0.0f, 1.0f, 1.0f },
+            0.0f,
+            { border_color.r, border_color.g, border_color.b, 1.0f }
+        };
+
+        add_instance(0, instance);
+    }
+
+    void ImageRenderer::end()
+    {
+        flush();
     }
 
     void ImageRenderer::render(const Image& img, int x, int y, const Camera& cam, float opacity, bool has_border, Color border_color)
     {
-        glUseProgram(m_shader_prog);
+        begin(cam);
+        add(img, x, y, opacity, has_border, border_color);
+        end();
+    }
 
-        GLint u_camera = glGetUniformLocation(m_shader_prog, "Camera");
-        glUniform3f(u_camera, cam.x, cam.y, cam.zoom);
-        
-        GLint u_img_dim = glGetUniformLocation(m_shader_prog, "ImageDimensions");
-        glUniform2f(u_img_dim, (float)img.get_width(), (float)img.get_height());
+    int ImageRenderer::get_n_draw_calls() const
+    {
+        return m_n_draw_calls;
+    }
 
-        GLint u_img_pos = glGetUniformLocation(m_shader_prog, "ImagePosition");
-        glUniform2f(u_img_pos, (float)x, (float)y);
+    int ImageRenderer::get_n_culled() const
+    {
+        return m_n_culled;
+    }
 
-        GLint u_opacity = glGetUniformLocation(m_shader_prog, "Opacity");
-        glUniform1f(u_opacity, opacity);
+    bool ImageRenderer::has_pending_uploads() const
+    {
+        return m_uploader.has_deferred();
+    }
 
-        GLint u_has_border = glGetUniformLocation(m_shader_prog, "HasBorder");
-        glUniform1f(u_has_border, has_border ? 1.0f : 0.0f);
+    void ImageRenderer::get_visible_rect(const Camera& cam, float& x, float& y, float& width, float& height)
+    {
+        // Inverse of the transformation in the vertex shader (the y flip is symmetric)
+        x = -1.0f / cam.zoom - cam.x;
+        y = -1.0f / cam.zoom - cam.y;
+        width = 2.0f / cam.zoom;
+        height = 2.0f / cam.zoom;
+    }
 
-        GLint u_border_color = glGetUniformLocation(m_shader_prog, "BorderColor");
-        glUniform3f(u_border_color, border_color.r, border_color.g, border_color.b);
-    
-        glEnableVertexAttribArray(0);
-        glEnableVertexAttribArray(1);
+    bool ImageRenderer::is_visible(float x, float y, float width, float height) const
+    {
+        float view_x, view_y, view_width, view_height;
+        get_visible_rect(m_camera, view_x, view_y, view_width, view_height);
 
-        glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
+        return x < view_x + view_width && x + width > view_x &&
+               y < view_y + view_height && y + height > view_y;
+    }
 
-        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (const GLvoid*)offsetof(Vertex, pos));
-        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (const GLvoid*)offsetof(Vertex, uvCoords));
+    // Coarsest downsampling level that still has about one texel per screen pixel
+    int ImageRenderer::get_texture_level(int texel_width, int texel_height, float world_width, float world_height) const
+    {
+        float screen_width = world_width * m_camera.zoom * 0.5f * m_viewport_width;
+        float screen_height = world_height * m_camera.zoom * 0.5f * m_viewport_height;
+
+        float ratio = std::min(texel_width / std::max(screen_width, 1.0f), texel_height / std::max(screen_height, 1.0f));
+        if (ratio <= 1.0f)
+            return 0;
+
+        return std::clamp((int)std::floor(std::log2(ratio)), 0, 15);
+    }
+
+    int ImageRenderer::get_texture_level(int width, int height) const
+    {
+        return get_texture_level(width, height, (float)width, (float)height);
+    }
 
-        img.push_changes();
-        img.bind();
+    void ImageRenderer::add_instance(GLuint texture, const Instance& instance)
+    {
+        if (!m_batch.empty() && texture != m_batch_texture)
+            flush();
 
-        glDrawArrays(GL_TRIANGLES, 0, 6);
+        m_batch_texture = texture;
+        m_batch.push_back(instance);
+    }
 
-        glDisableVertexAttribArray(1);
-        glDisableVertexAttribArray(0);
+    void ImageRenderer::flush()
+    {
+        if (m_batch.empty())
+            return;
+
+        glUseProgram(m_shader_prog);
+
+        glUniform3f(m_u_camera, m_camera.x, m_camera.y, m_camera.zoom);
+        glUniform1i(m_u_sampler, 0);
+        glUniform1f(m_u_has_texture, m_batch_texture ? 1.0f : 0.0f);
+
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, m_batch_texture);
+
+        // Orphan the previous contents, the driver does not have to wait for pending draws
+        glBindBuffer(GL_ARRAY_BUFFER, m_instance_vbo);
+        glBufferData(GL_ARRAY_BUFFER, m_batch.size() * sizeof(Instance), nullptr, GL_STREAM_DRAW);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, m_batch.size() * sizeof(Instance), m_batch.data());
+
+        glBindVertexArray(m_vao);
+        glDrawArraysInstanced(GL_TRIANGLES, 0, 6, (GLsizei)m_batch.size());
+        glBindVertexArray(0);
 
         glUseProgram(0);
+
+        ++m_n_draw_calls;
+        m_batch.clear();
     }
 
     void ImageRenderer::generate_vertex_buffer()
@@ -123,6 +282,39 @@ namespace ns
         glGenBuffers(1, &m_vbo);
         glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
         glBufferData(GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STATIC_DRAW);
+
+        glGenBuffers(1, &m_instance_vbo);
+    }
+
+    void ImageRenderer::generate_vertex_array()
+    {
+        glGenVertexArrays(1, &m_vao);
+        glBindVertexArray(m_vao);
+
+        glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
+
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (const GLvoid*)offsetof(Vertex, pos));
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (const GLvoid*)offsetof(Vertex, uvCoords));
+
+        glBindBuffer(GL_ARRAY_BUFFER, m_instance_vbo);
+
+        glEnableVertexAttribArray(2);
+        glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, sizeof(Instance), (const GLvoid*)offsetof(Instance, rect));
+        glVertexAttribDivisor(2, 1);
+        glEnableVertexAttribArray(3);
+        glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, sizeof(Instance), (const GLvoid*)offsetof(Instance, opacity));
+        glVertexAttribDivisor(3, 1);
+        glEnableVertexAttribArray(4);
+        glVertexAttribPointer(4, 4, GL_FLOAT, GL_FALSE, sizeof(Instance), (const GLvoid*)offsetof(Instance, border));
+        glVertexAttribDivisor(4, 1);
+        glEnableVertexAttribArray(5);
+        glVertexAttribPointer(5, 4, GL_FLOAT, GL_FALSE, sizeof(Instance), (const GLvoid*)offsetof(Instance, uv));
+        glVertexAttribDivisor(5, 1);
+
+        glBindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
     }
 
     void ImageRenderer::load_shader_program()
@@ -0,0 +1,143 @@
+#include "MappedCanvas.h"
+
+#include <cstdio>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+namespace ns
+{
+    MappedCanvas::MappedCanvas()
+        : m_fd(-1), m_p_data(nullptr), m_file_size(0),
+          m_width(0), m_height(0), m_n_tiles_x(0)
+    {}
+
+    MappedCanvas::~MappedCanvas()
+    {
+        close();
+    }
+
+    bool MappedCanvas::create(const std::string& filepath, int width, int height)
+    {
+        close();
+
+        m_n_tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+        int n_tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+        size_t file_size = (size_t)m_n_tiles_x * n_tiles_y * TILE_BYTES;
+
+        m_fd = open(filepath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (m_fd < 0)
+        {
+            printf("Unable to create canvas file %s\n", filepath.c_str());
+            return false;
+        }
+        m_filepath = filepath;
+
+        // Only extends the file, no blocks are allocated until tiles are written
+        if (ftruncate(m_fd, (off_t)file_size) != 0)
+        {
+            printf("Unable to resize canvas file %s to %lu MiB\n", filepath.c_str(), file_size >> 20);
+            close();
+            return false;
+        }
+
+        void* p_data = mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+        if (p_data == MAP_FAILED)
+        {
+            printf("Unable to map canvas file %s\n", filepath.c_str());
+            close();
+            return false;
+        }
+
+        m_p_data = static_cast<uint8_t*>(p_data);
+        m_file_size = file_size;
+        m_width = width;
+        m_height = height;
+
+        return true;
+    }
+
+    void MappedCanvas::close()
+    {
+        if (m_p_data)
+            munmap(m_p_data, m_file_size);
+
+        if (m_fd >= 0)
+        {
+            ::close(m_fd);
+            unlink(m_filepath.c_str());
+        }
+
+        m_fd = -1;
+        m_p_data = nullptr;
+        m_file_size = 0;
+        m_filepath.clear();
+    }
+
+    MappedCanvas::Span MappedCanvas::get_span(int tile_x, int y) const
+    {
+        size_t tile_index = (size_t)(y / TILE_SIZE) * m_n_tiles_x + tile_x;
+        uint8_t* p_tile = m_p_data + tile_index * TILE_BYTES;
+        size_t offset = (size_t)(y % TILE_SIZE) * TILE_SIZE;
+
+        auto* r = reinterpret_cast<float*>(p_tile);
+        auto* g = r + TILE_PIXELS;
+        auto* b = g + TILE_PIXELS;
+        auto* n = reinterpret_cast<uint16_t*>(b + TILE_PIXELS);
+
+        return { r + offset, g + offset, b + offset, n + offset };
+    }
+
+    int MappedCanvas::get_width() const
+    {
+        return m_width;
+    }
+
+    int MappedCanvas::get_height() const
+    {
+        return m_height;
+    }
+
+    int MappedCanvas::get_n_tiles_x() const
+    {
+        return m_n_tiles_x;
+    }
+
+    size_t MappedCanvas::get_file_size() const
+    {
+        return m_file_size;
+    }
+
+    void MappedCanvas::advise_random() const
+    {
+        if (m_p_data)
+            madvise(m_p_data, m_file_size, MADV_RANDOM);
+    }
+
+    void MappedCanvas::advise_sequential() const
+    {
+        if (m_p_data)
+            madvise(m_p_data, m_file_size, MADV_SEQUENTIAL);
+    }
+
+    void MappedCanvas::discard_rows(int y0, int y1) const
+    {
+        if (!m_p_data)
+            return;
+
+        // Only whole tile rows can be discarded, they are contiguous in the file
+        size_t tile_y0 = (y0 + TILE_SIZE - 1) / TILE_SIZE;
+        size_t tile_y1 = y1 >= m_height ? (m_height + TILE_SIZE - 1) / TILE_SIZE : y1 / TILE_SIZE;
+
+        if (tile_y1 <= tile_y0)
+            return;
+
+        size_t begin = tile_y0 * m_n_tiles_x * TILE_BYTES;
+        size_t end = tile_y1 * m_n_tiles_x * TILE_BYTES;
+
+        // Punching a hole frees the blocks without writing dirty pages back first
+        fallocate(m_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)begin, (off_t)(end - begin));
+        madvise(m_p_data + begin, end - begin, MADV_DONTNEED);
+    }
+}
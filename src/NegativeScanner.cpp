@@ -5,14 +5,25 @@
 #include <algorithm>
 #include <filesystem>
 #include <shared_mutex>
+#include <memory>
+#include <sstream>
+#include <iomanip>
+#include <chrono>
+#include <limits>
 #include <cmath>
 
 #include "glInit.h"
 #include "Window.h"
 #include "ImageRenderer.h"
 #include "Camera.h"
-#include "ThreadPool.h"
+#include "Parallel.h"
+#include "PositionSolver.h"
+#include "SpatialIndex.h"
+#include "ImageGrid.h"
 #include "ReadWriteMutex.h"
+#include "PixelBufferPool.h"
+#include "ThumbnailAtlas.h"
+#include "Compositor.h"
 
 constexpr ns::Color COLOR_GREY       = { 0.5f, 0.5f, 0.5f, 1.0f };
 constexpr ns::Color COLOR_RED        = { 1.0f, 0.0f, 0.0f, 1.0f };
@@ -21,16 +32,20 @@ constexpr ns::Color COLOR_BLUE       = { 0.0f, 0.0f, 1.0f, 1.0f };
 constexpr ns::Color COLOR_TURQUOISE  = { 0.2f, 0.5f, 0.3f, 1.0f };
 constexpr ns::Color COLOR_LIGHT_BLUE = { 0.4f, 0.4f, 1.0f, 1.0f };
 constexpr ns::Color COLOR_ORANGE     = { 1.0f, 0.6f, 0.0f, 1.0f };
+constexpr ns::Color COLOR_YELLOW     = { 1.0f, 1.0f, 0.0f, 1.0f };
+constexpr ns::Color COLOR_PURPLE     = { 0.7f, 0.0f, 1.0f, 1.0f };
 
 constexpr size_t MAX_LOADED_IMAGES = 160;
+constexpr size_t COMPOSITE_MEMORY_BUDGET = (size_t)2 << 30; // Strips and sources of the final image
+constexpr int COMPOSITE_BIT_DEPTH = 8; // 8 or 16 bits per channel in the final image
+constexpr bool COMPOSITE_USE_MAPPED_CANVAS = false; // Accumulate the final image in a file for mosaics larger than the memory
 constexpr int MAX_ITER_TEST_LOCAL_MINIMUM = 16;
+constexpr float MIN_AUTO_CONFIDENCE = 0.05f;
+constexpr float MIN_PAIR_OVERLAP = 0.02f; // Fraction of the image area
 
-struct ImageID
-{
-    int x, y;
-};
-
-bool operator==(const ImageID& iid1, const ImageID& iid2) { return iid1.x == iid2.x && iid1.y == iid2.y; }
+using ns::ImageID;
+using ns::ImageInfo;
+using ns::ImageInfoRef;
 
 struct ImageExt
 {
@@ -39,33 +54,23 @@ struct ImageExt
     ns::Image img;
 };
 
-struct ImageExtLocked
+// Loaded image of one grid slot, only accessed with std::atomic_load/std::atomic_store.
+// Loading or evicting relinks the pointer, readers keep their own reference.
+struct ImageSlot
 {
-    const ImageExt* p_img_ext;
-    std::shared_lock<std::shared_mutex> lock;
-public:
-    const ImageExt& operator*() const { return *p_img_ext; }
-    const ImageExt* operator->() { return p_img_ext; }
-public:
-    operator bool() { return p_img_ext; }
+    std::shared_ptr<const ImageExt> p_img_ext;
 };
 
-bool operator<(const ImageID& iid1, const ImageID& iid2)
-{
-    if (iid1.x == iid2.x)
-        return iid1.y < iid2.y;
-    return iid1.x < iid2.x;
-}
-bool operator<(const ImageID& iid, const ImageExt& ie) { return iid < ie.id; }
-bool operator<(const ImageExt& ie, const ImageID& iid) { return ie.id < iid; }
-bool operator<(const ImageExt& ie1, const ImageExt& ie2) { return ie1.id < ie2.id; }
-
-struct ImageInfo
+// Reference to a loaded image, keeps the pixels alive after eviction until released
+struct ImageHandle
 {
-    int pos_x, pos_y;
-    int width, height;
-    bool has_been_adjusted;
-    bool ignore;
+    std::shared_ptr<const ImageExt> p_img_ext;
+public:
+    const ImageExt& operator*() const { return *p_img_ext; }
+    const ImageExt* operator->() const { return p_img_ext.get(); }
+public:
+    operator bool() const { return (bool)p_img_ext; }
+    void release() { p_img_ext.reset(); }
 };
 
 struct Rect
@@ -74,29 +79,53 @@ struct Rect
     int w, h;
 };
 
-struct DiffScoreThreadData
+// Pixel difference used for scoring alignments
+enum class DiffMetric : uint32_t
+{
+    AlphaAbsDiff = 0, // Absolute difference of the filtered alpha channel (squared brightness)
+};
+
+// Relative offset between two overlapping images, measured by aligning b against a alone
+struct PairOffset
 {
-    int min_x, min_y;
-    int off_x, off_y;
-    int step_size;
-    std::vector<std::vector<float>>* p_diff_scores;
+    ImageID img_id_a, img_id_b;
+    int off_x, off_y; // Position of b relative to a
+    bool reached_local_minimum;
+    float diff_score;
+    float confidence;
+    DiffMetric metric;
+    bool is_outdated; // Set when one of the images has been moved by hand
 };
 
-ns::ThreadPool<DiffScoreThreadData> g_thread_pool(32);
+ns::TaskPool g_thread_pool(32);
+
+// Work posted by background tasks to run on the user thread, which is woken through g_events
+std::mutex g_user_tasks_mtx;
+std::vector<ns::Task> g_user_tasks;
+std::atomic<ns::Events*> g_events = nullptr;
+
+constexpr int FRAME_CAP = 60;
+std::atomic<ns::Window*> g_p_window = nullptr; // Only set while the window is open
 
 std::filesystem::path g_capture_dir;
 
 ns::Camera g_camera = { 0.0f, 0.0f, 0.0005f };
 
+// Guards the bookkeeping of loaded images (g_loaded_slots, base and pinned ids), not the pixels
 std::shared_mutex g_images_mtx;
 
-std::set<ImageExt, std::less<>> g_loaded_images;
+std::unique_ptr<ImageSlot[]> g_image_slots; // Indexed by grid slot
+std::vector<size_t> g_loaded_slots; // Slots holding an image, considered for eviction
 
-std::set<ImageID> g_image_base_ids;
-ImageID g_image_current_id;
+std::set<ImageID> g_image_base_ids; // Only changed by the render thread, which reads it without the lock
+std::set<ImageID> g_pinned_image_ids; // Kept loaded for batch processing
+ImageID g_image_current_id = { -1, -1 }; // Set by update_images once the first image is loaded
 ImageExt g_image_overlap;
 ImageInfo g_image_overlap_info;
 
+// Thumbnails of the whole roll, filled in by a background task, only accessed with std::atomic_load/std::atomic_store
+std::shared_ptr<const ns::ThumbnailAtlas> g_p_thumbnail_atlas;
+
 bool g_max_image_use_distance_enabled = false;
 int g_max_image_use_distance = 0;
 bool g_hide_image_current = false;
@@ -105,6 +134,24 @@ int g_image_current_init_y = 0;
 float g_image_current_opacity = 0.5f;
 ns::Color g_image_current_border_color = COLOR_GREY;
 
+// Guards all position writes, so running alignments never publish after being cancelled and
+// alignment contexts see consistent positions
+std::mutex g_alignment_mtx;
+std::atomic_uint64_t g_alignment_generation = 0;
+
+struct Speculation
+{
+    ImageID img_id;
+    int pos_x, pos_y;
+    bool is_done;
+    bool reached_local_minimum;
+};
+
+// Speculative alignment of the image following the current one
+std::mutex g_speculation_mtx;
+std::atomic_uint64_t g_speculation_generation = 0;
+Speculation g_speculation = { { -1, -1 }, 0, 0, false, false };
+
 int g_test_range = 3;
 ImageID g_next_id = { 1, 0 };
 bool g_view_image_overlap = false;
@@ -113,7 +160,19 @@ bool g_make_images_base_transparent = false;
 bool g_select_image_with_mouse = false;
 ImageID g_img_id_closest_to_mouse;
 
-std::vector<std::vector<ImageInfo>> g_image_info;
+ns::ImageGrid g_image_grid;
+
+// Rectangles of all adjusted images, keyed by grid slot
+ns::SpatialIndex g_image_index;
+
+// Pairwise alignment graph, persisted with the project
+std::mutex g_pair_offsets_mtx;
+std::map<std::pair<ImageID, ImageID>, PairOffset> g_pair_offsets;
+std::atomic_bool g_is_optimizing = false; // Only one global optimization runs at a time
+
+// Images placed with low confidence by the automatic stitching
+std::mutex g_review_ids_mtx;
+std::set<ImageID> g_review_ids;
 
 template <typename T>
 std::istream& read_bin(std::istream& is, T& data)
@@ -127,6 +186,128 @@ std::ostream& write_bin(std::ostream& os, const T& data)
     return os.write(reinterpret_cast<const char*>(&data), sizeof(data));
 }
 
+// Optional data is stored in tagged sections after the fixed part of the project file.
+// Unknown sections are skipped when loading, files without sections load as before.
+enum class ProjectSection : uint32_t
+{
+    ReviewIDs = 1,
+    PairOffsets = 2,
+    SparseIDs = 3, // IDs of the captures present in a sparse grid
+};
+
+void write_section(std::ostream& os, ProjectSection section, const std::string& data)
+{
+    write_bin(os, section);
+    write_bin(os, (uint64_t)data.size());
+    os.write(data.data(), data.size());
+}
+
+void load_review_ids(std::istream& is)
+{
+    std::lock_guard lock(g_review_ids_mtx);
+
+    uint64_t count;
+    read_bin(is, count);
+
+    g_review_ids.clear();
+    while (count-- > 0)
+    {
+        ImageID img_id;
+        read_bin(is, img_id);
+        g_review_ids.insert(img_id);
+    }
+}
+
+void load_pair_offsets(std::istream& is)
+{
+    std::lock_guard lock(g_pair_offsets_mtx);
+
+    uint64_t count;
+    read_bin(is, count);
+
+    g_pair_offsets.clear();
+    while (count-- > 0)
+    {
+        PairOffset pair;
+        read_bin(is, pair.img_id_a);
+        read_bin(is, pair.img_id_b);
+        read_bin(is, pair.off_x);
+        read_bin(is, pair.off_y);
+        read_bin(is, pair.reached_local_minimum);
+        read_bin(is, pair.diff_score);
+        read_bin(is, pair.confidence);
+        read_bin(is, pair.metric);
+        read_bin(is, pair.is_outdated);
+
+        g_pair_offsets.insert({ { pair.img_id_a, pair.img_id_b }, pair });
+    }
+}
+
+std::string save_pair_offsets()
+{
+    std::lock_guard lock(g_pair_offsets_mtx);
+
+    std::stringstream ss;
+
+    write_bin(ss, (uint64_t)g_pair_offsets.size());
+    for (auto& [key, pair] : g_pair_offsets)
+    {
+        write_bin(ss, pair.img_id_a);
+        write_bin(ss, pair.img_id_b);
+        write_bin(ss, pair.off_x);
+        write_bin(ss, pair.off_y);
+        write_bin(ss, pair.reached_local_minimum);
+        write_bin(ss, pair.diff_score);
+        write_bin(ss, pair.confidence);
+        write_bin(ss, pair.metric);
+        write_bin(ss, pair.is_outdated);
+    }
+
+    return ss.str();
+}
+
+void load_sparse_ids(std::istream& is, std::vector<ImageID>& ids)
+{
+    uint64_t count;
+    read_bin(is, count);
+
+    ids.clear();
+    ids.reserve(count);
+    while (count-- > 0)
+    {
+        ImageID img_id;
+        read_bin(is, img_id);
+        ids.push_back(img_id);
+    }
+}
+
+std::string save_sparse_ids()
+{
+    std::stringstream ss;
+
+    write_bin(ss, (uint64_t)g_image_grid.size());
+    for (size_t slot = 0; slot < g_image_grid.size(); ++slot)
+        write_bin(ss, g_image_grid.get_id(slot));
+
+    return ss.str();
+}
+
+std::string save_review_ids()
+{
+    std::lock_guard lock(g_review_ids_mtx);
+
+    std::stringstream ss;
+
+    write_bin(ss, (uint64_t)g_review_ids.size());
+    for (auto& img_id : g_review_ids)
+        write_bin(ss, img_id);
+
+    return ss.str();
+}
+
+void rebuild_img_index();
+void init_image_slots();
+
 void load_project_from_file(const std::filesystem::path& filepath)
 {
     std::ifstream file(filepath, std::ios::binary);
@@ -175,24 +356,69 @@ void load_project_from_file(const std::filesystem::path& filepath)
     // Load g_make_images_base_transparent
     read_bin(file, g_make_images_base_transparent);
 
-    // Load g_image_info
+    // Load g_image_grid (the grid is built after the sections, a sparse grid lists its IDs in one of them)
+    size_t width, height;
+    read_bin(file, width);
+    read_bin(file, height);
+
+    std::vector<ImageInfo> img_infos(width * height);
+    for (auto& img_info : img_infos)
+        read_bin(file, img_info);
+
+    bool is_sparse = false;
+    std::vector<ImageID> sparse_ids;
+
+    // Load optional sections
+    while (file.peek() != std::ifstream::traits_type::eof())
     {
-        size_t width, height;
-        read_bin(file, width);
-        read_bin(file, height);
+        ProjectSection section;
+        uint64_t size;
+        read_bin(file, section);
+        read_bin(file, size);
 
-        g_image_info = std::vector<std::vector<ImageInfo>>(width, std::vector<ImageInfo>(height, ImageInfo{}));
+        std::string data(size, '\0');
+        file.read(data.data(), size);
 
-        for (int id_x = 0; id_x < (int)width; ++id_x)
+        if (!file.good())
         {
-            for (int id_y = 0; id_y < (int)height; ++id_y)
-            {
-                auto& img_info = g_image_info[id_x][id_y];
-                read_bin(file, img_info);
-            }
+            printf("Project file %s is truncated\n", filepath.c_str());
+            break;
+        }
+
+        std::stringstream ss(data);
+        switch (section)
+        {
+        case ProjectSection::ReviewIDs:
+            load_review_ids(ss);
+            break;
+        case ProjectSection::PairOffsets:
+            load_pair_offsets(ss);
+            break;
+        case ProjectSection::SparseIDs:
+            is_sparse = true;
+            load_sparse_ids(ss, sparse_ids);
+            break;
+        default:
+            printf("Skipping unknown project section %u\n", (unsigned int)section);
+            break;
         }
     }
 
+    if (is_sparse)
+        g_image_grid = ns::ImageGrid(width, height, std::move(sparse_ids));
+    else
+        g_image_grid = ns::ImageGrid(width, height);
+
+    init_image_slots();
+
+    for (size_t slot = 0; slot < g_image_grid.size(); ++slot)
+    {
+        auto img_id = g_image_grid.get_id(slot);
+        g_image_grid.set_info(slot, img_infos[img_id.x * height + img_id.y]);
+    }
+
+    rebuild_img_index();
+
     printf("DONE!\n");
 }
 
@@ -244,19 +470,25 @@ void save_project_to_file()
     // Save g_make_images_base_transparent
     write_bin(file, g_make_images_base_transparent);
 
-    // Save g_image_info
-    write_bin(file, g_image_info.size());
-    write_bin(file, g_image_info[0].size());
+    // Save g_image_grid (slots missing from a sparse grid are stored as empty infos)
+    write_bin(file, (size_t)g_image_grid.get_size_x());
+    write_bin(file, (size_t)g_image_grid.get_size_y());
 
-    for (int id_x = 0; id_x < (int)g_image_info.size(); ++id_x)
+    for (int id_x = 0; id_x < g_image_grid.get_size_x(); ++id_x)
     {
-        for (int id_y = 0; id_y < (int)g_image_info[0].size(); ++id_y)
+        for (int id_y = 0; id_y < g_image_grid.get_size_y(); ++id_y)
         {
-            auto& img_info = g_image_info[id_x][id_y];
-            write_bin(file, img_info);
+            size_t slot = g_image_grid.find({ id_x, id_y });
+            write_bin(file, slot != ns::ImageGrid::npos ? g_image_grid.get_info(slot) : ImageInfo{});
         }
     }
 
+    // Save optional sections
+    if (g_image_grid.is_sparse())
+        write_section(file, ProjectSection::SparseIDs, save_sparse_ids());
+    write_section(file, ProjectSection::ReviewIDs, save_review_ids());
+    write_section(file, ProjectSection::PairOffsets, save_pair_offsets());
+
     printf("DONE!\n");
 }
 
@@ -292,29 +524,109 @@ std::string get_filename_from_ids(int id_x, int id_y)
     return ss.str();
 }
 
-ImageInfo& get_img_info_from_id(const ImageID& img_id)
+// First image of the grid, all others are aligned relative to it
+ImageID get_reference_id()
+{
+    if (g_image_grid.size() == 0)
+        return { -1, -1 };
+
+    return g_image_grid.get_id(0);
+}
+
+// False until update_images has loaded the first image
+bool has_current_image()
+{
+    return g_image_grid.contains(g_image_current_id);
+}
+
+ImageInfoRef get_img_info_from_id(const ImageID& img_id)
 {
-    return g_image_info[img_id.x][img_id.y];
+    return g_image_grid[img_id];
 }
 
-ImageInfo& get_img_info_from_ext(const ImageExt& img_ext)
+ImageInfoRef get_img_info_from_ext(const ImageExt& img_ext)
 {
     return get_img_info_from_id(img_ext.id);
 }
 
-ImageExtLocked get_img_ext_from_id(const ImageID& img_id)
+size_t get_img_index_key(const ImageID& img_id)
+{
+    return g_image_grid.find(img_id);
+}
+
+ImageID get_img_id_from_index_key(size_t key)
+{
+    return g_image_grid.get_id(key);
+}
+
+// Must be called whenever position, size or adjustment state of an image changes
+void update_img_index(const ImageID& img_id)
 {
-    ImageExtLocked iel;
-    iel.p_img_ext = nullptr;
-    iel.lock = std::shared_lock(g_images_mtx);
+    auto img_info = get_img_info_from_id(img_id);
 
-    auto it = g_loaded_images.find(img_id);
-    if (it != g_loaded_images.end())
-        iel.p_img_ext = &*it;
+    if (img_info.has_been_adjusted)
+        g_image_index.update(get_img_index_key(img_id), { img_info.pos_x, img_info.pos_y, img_info.width, img_info.height });
     else
-        iel.lock.unlock();
+        g_image_index.remove(get_img_index_key(img_id));
+}
+
+void rebuild_img_index()
+{
+    g_image_index.clear();
+
+    int max_size = 0;
+
+    g_image_grid.for_each([&](const ImageID& img_id, ImageInfoRef img_info)
+        {
+            max_size = std::max({ max_size, img_info.width, img_info.height });
+
+            update_img_index(img_id);
+        }
+    );
+
+    // Cells of about one image keep the number of cells per query small
+    if (max_size > 0)
+        g_image_index.set_cell_size(max_size);
+}
+
+void init_image_slots()
+{
+    std::unique_lock lock(g_images_mtx);
+
+    g_image_slots = std::make_unique<ImageSlot[]>(g_image_grid.size());
+    g_loaded_slots.clear();
+}
+
+ImageHandle get_img_ext_from_id(const ImageID& img_id)
+{
+    ImageHandle handle;
+
+    size_t slot = g_image_grid.find(img_id);
+    if (slot != ns::ImageGrid::npos)
+        handle.p_img_ext = std::atomic_load(&g_image_slots[slot].p_img_ext);
+
+    return handle;
+}
+
+bool is_img_loaded(const ImageID& img_id)
+{
+    return (bool)get_img_ext_from_id(img_id);
+}
+
+// Unlinks the image of a slot, the pixels are freed once the last handle is released
+void unload_image_slot(size_t slot)
+{
+    std::shared_ptr<const ImageExt> p_img_ext;
+
+    {
+        std::unique_lock lock(g_images_mtx);
 
-    return iel;
+        auto it = std::find(g_loaded_slots.begin(), g_loaded_slots.end(), slot);
+        if (it != g_loaded_slots.end())
+            g_loaded_slots.erase(it);
+
+        p_img_ext = std::atomic_exchange(&g_image_slots[slot].p_img_ext, std::shared_ptr<const ImageExt>());
+    }
 }
 
 int get_img_dist(const ImageInfo& img_info_1, const ImageInfo& img_info_2)
@@ -326,8 +638,8 @@ int get_img_dist(const ImageInfo& img_info_1, const ImageInfo& img_info_2)
 
 int get_img_dist(const ImageID& img_id_1, const ImageID& img_id_2)
 {
-    auto& img_info_1 = get_img_info_from_id(img_id_1);
-    auto& img_info_2 = get_img_info_from_id(img_id_2);
+    auto img_info_1 = get_img_info_from_id(img_id_1);
+    auto img_info_2 = get_img_info_from_id(img_id_2);
     return get_img_dist(img_info_1, img_info_2);
 }
 
@@ -356,14 +668,14 @@ Rect get_overlap_rect(const Rect& rect, const ImageInfo& img_info)
 
 Rect get_overlap_rect(int off_x, int off_y)
 {
-    auto& img_info_curr = get_img_info_from_id(g_image_current_id);
+    auto img_info_curr = get_img_info_from_id(g_image_current_id);
     Rect rect = get_rect_from_img_info(img_info_curr);
     rect.x += off_x;
     rect.y += off_y;
 
     for (auto& img_base_id : g_image_base_ids)
     {
-        auto& img_info_base = get_img_info_from_id(img_base_id);
+        auto img_info_base = get_img_info_from_id(img_base_id);
         rect = get_overlap_rect(rect, img_info_base);
     }
 
@@ -378,33 +690,54 @@ bool image_overlap_is_outdated()
            r.w != g_image_overlap.img.get_width() || r.h != g_image_overlap.img.get_height();
 }
 
-ImageID load_image(int id_x, int id_y, bool make_viewable = true, bool use_filter = true)
+ns::Color reverse_vignette(ns::Color c, float u, float v)
 {
-    // Check if image has already been loaded
+    u = (u - 0.5f) * 2.0f;
+    v = (v - 0.5f) * 2.0f;
+    float m = 1.5f;
+    float s = std::sqrt(u*u + v*v) / m + 1.0f - 1.0f / m;
+    c.r *= s;
+    c.g *= s;
+    c.b *= s;
+    c.a = c.r * c.r + c.g * c.g + c.b * c.b;
+    return c;
+}
+
+// Returns a handle to the loaded image, which stays valid even if the slot is evicted by another thread
+ImageHandle load_image(int id_x, int id_y, bool make_viewable = true, bool use_filter = true)
+{
+    size_t slot = g_image_grid.find({ id_x, id_y });
+    if (slot == ns::ImageGrid::npos)
     {
-        std::unique_lock lock(g_images_mtx);
+        printf("Image %d/%d is not part of the capture\n", id_x, id_y);
+        return {};
+    }
 
-        auto it = g_loaded_images.find(ImageID{ id_x, id_y });
-        if (it != g_loaded_images.end())
+    // Check if image has already been loaded
+    if (auto img_ext = get_img_ext_from_id({ id_x, id_y }))
+    {
+        // If same settings applied, return image id. Textures are created lazily, so an image
+        // loaded for alignment only becomes viewable without reloading its pixels.
+        if (img_ext->is_filtered == use_filter)
         {
-            // If same settings applied, return image id
-            if (it->is_filtered == use_filter &&
-                it->img.is_viewable() == make_viewable)
-            {
-                printf("Loaded in-memory image %d/%d\n", id_x, id_y);
-                return { id_x, id_y };
-            }
-            else // Otherwise remove loaded image and continue loading the correct one
-            {
-                g_loaded_images.erase(it);
-                g_image_base_ids.erase({ id_x, id_y });
-                printf("Removed image %d/%d with wrong settings\n", id_x, id_y);
-            }
+            if (make_viewable)
+                img_ext->img.make_viewable();
+
+            printf("Loaded in-memory image %d/%d\n", id_x, id_y);
+            return img_ext;
         }
+
+        // Otherwise remove loaded image and continue loading the correct one
+        img_ext.release();
+        unload_image_slot(slot);
+        printf("Removed image %d/%d with wrong settings\n", id_x, id_y);
     }
 
     printf("Loading image %d/%d from disk...\n", id_x, id_y);
 
+    // Counted for the whole process, other threads add to it while loading
+    long n_page_faults = ns::PixelBufferPool::get_page_faults();
+
     ImageExt img_ext;
     img_ext.id.x = id_x;
     img_ext.id.y = id_y;
@@ -412,64 +745,108 @@ ImageID load_image(int id_x, int id_y, bool make_viewable = true, bool use_filte
 
     std::string filepath = g_capture_dir / get_filename_from_ids(id_x, id_y);
 
-    auto reverse_vignette = [](ns::Color c, float u, float v)
-    {
-        u = (u - 0.5f) * 2.0f;
-        v = (v - 0.5f) * 2.0f;
-        float m = 1.5f;
-        float s = std::sqrt(u*u + v*v) / m + 1.0f - 1.0f / m;
-        c.r *= s;
-        c.g *= s;
-        c.b *= s;
-        c.a = c.r * c.r + c.g * c.g + c.b * c.b;
-        return c;
-    };
+    img_ext.img = ns::Image::load_from_file(filepath, make_viewable);
 
     if (use_filter)
-        img_ext.img = ns::Image::load_from_file(filepath, make_viewable, reverse_vignette);
-    else
-        img_ext.img = ns::Image::load_from_file(filepath, make_viewable);
+    {
+        auto& img = img_ext.img;
+        float width = (float)img.get_width();
+        float height = (float)img.get_height();
+
+        ns::parallel_for(
+            g_thread_pool, 0, img.get_height(), 0,
+            [&](int64_t y_begin, int64_t y_end)
+            {
+                for (int y = (int)y_begin; y < (int)y_end; ++y)
+                {
+                    ns::Color* row = img.get_mutable_row(y);
+                    for (int x = 0; x < img.get_width(); ++x)
+                        row[x] = reverse_vignette(row[x], x / width, y / height);
+                }
+            }
+        );
+    }
 
-    auto& img_info = get_img_info_from_ext(img_ext);
-    img_info.width = img_ext.img.get_width();
-    img_info.height = img_ext.img.get_height();
+    printf("Loaded image %d/%d with %ld page faults\n", id_x, id_y, ns::PixelBufferPool::get_page_faults() - n_page_faults);
 
+    {
+        // The sizes are read by the alignment workers and the render thread
+        std::lock_guard lock(g_alignment_mtx);
 
-    std::unique_lock lock(g_images_mtx);
+        auto img_info = get_img_info_from_ext(img_ext);
+        img_info.width = img_ext.img.get_width();
+        img_info.height = img_ext.img.get_height();
+
+        // All captures share one size, so the index is only rebuilt once
+        g_image_index.set_cell_size(std::max(img_info.width, img_info.height));
+        update_img_index(img_ext.id);
+    }
+
+
+    ImageHandle handle;
+    handle.p_img_ext = std::make_shared<ImageExt>(std::move(img_ext));
 
-    if (g_loaded_images.size() >= MAX_LOADED_IMAGES)
+    // Released after the lock, the last handle frees the pixels
+    std::shared_ptr<const ImageExt> p_evicted_img_ext;
+
+    // The slots are listed and their handles set under the same lock, so that a concurrent
+    // eviction or reload of a slot can never be undone by this one
     {
-        printf("Image buffer full, searching best candidate to remove...\n");
+        std::unique_lock lock(g_images_mtx);
 
-        int furthest_dist = 0;
-        bool furthest_is_in_use = true;
-        ImageID furthest_img_id = { 0, 0 };
+        bool is_listed = std::find(g_loaded_slots.begin(), g_loaded_slots.end(), slot) != g_loaded_slots.end();
 
-        for (auto& img_ext : g_loaded_images)
+        if (!is_listed && g_loaded_slots.size() >= MAX_LOADED_IMAGES)
         {
-            int dist = get_img_dist(g_image_current_id, img_ext.id);
+            printf("Image buffer full, searching best candidate to remove...\n");
 
-            // Prefer images not in use
-            bool is_in_use = g_image_base_ids.find(img_ext.id) != g_image_base_ids.end();
+            int furthest_dist = -1;
+            bool furthest_is_in_use = true;
+            size_t furthest_index = 0;
 
-            if ((!is_in_use && furthest_is_in_use) ||
-                (dist > furthest_dist))
+            // No image is current before the first frame or without a window, distances are
+            // measured from the reference then
+            ImageID img_current_id = g_image_current_id;
+            if (!g_image_grid.contains(img_current_id))
+                img_current_id = get_reference_id();
+
+            for (size_t i = 0; i < g_loaded_slots.size(); ++i)
             {
-                furthest_dist = dist;
-                furthest_is_in_use = is_in_use;
-                furthest_img_id = img_ext.id;
+                ImageID loaded_id = g_image_grid.get_id(g_loaded_slots[i]);
+                int dist = get_img_dist(img_current_id, loaded_id);
+
+                // Images in use are only evicted if all are, the distance only decides between equals
+                bool is_in_use = g_image_base_ids.find(loaded_id) != g_image_base_ids.end() ||
+                                 g_pinned_image_ids.find(loaded_id) != g_pinned_image_ids.end();
+
+                bool is_better = is_in_use != furthest_is_in_use ? !is_in_use : dist > furthest_dist;
+                if (is_better)
+                {
+                    furthest_dist = dist;
+                    furthest_is_in_use = is_in_use;
+                    furthest_index = i;
+                }
             }
+
+            size_t furthest_slot = g_loaded_slots[furthest_index];
+            g_loaded_slots[furthest_index] = g_loaded_slots.back();
+            g_loaded_slots.pop_back();
+
+            // Readers still holding a handle to the evicted image keep it alive until they are done.
+            // Evicted bases stay listed, they are skipped while not loaded and reloaded by update_images.
+            ImageID furthest_img_id = g_image_grid.get_id(furthest_slot);
+            p_evicted_img_ext = std::atomic_exchange(&g_image_slots[furthest_slot].p_img_ext, std::shared_ptr<const ImageExt>());
+
+            printf("Removed image %d/%d from image buffer (in use?: %d)\n", furthest_img_id.x, furthest_img_id.y, (int)furthest_is_in_use);
         }
 
-        g_loaded_images.erase(g_loaded_images.find(furthest_img_id));
-        g_image_base_ids.erase(furthest_img_id);
+        if (!is_listed)
+            g_loaded_slots.push_back(slot);
 
-        printf("Removed image %d/%d from image buffer (in use?: %d)\n", furthest_img_id.x, furthest_img_id.y, (int)furthest_is_in_use);
+        std::atomic_store(&g_image_slots[slot].p_img_ext, handle.p_img_ext);
     }
 
-    g_loaded_images.insert(std::move(img_ext));
-
-    return { id_x, id_y };
+    return handle;
 }
 
 void render_final_image()
@@ -477,13 +854,11 @@ void render_final_image()
     printf("Retrieving final image dimensions...\n");
     int min_x = 0, min_y = 0;
     int max_x = 0, max_y = 0;
-    for (auto& row : g_image_info)
-    {
-        for (auto& img_info : row)
+    g_image_grid.for_each([&](const ImageID&, ImageInfoRef img_info)
         {
             // Skip unplaced images
             if (!img_info.has_been_adjusted || img_info.ignore)
-                continue;
+                return;
 
             if (img_info.pos_x < min_x)
                 min_x = img_info.pos_x;
@@ -495,78 +870,59 @@ void render_final_image()
             if (img_info.pos_y + img_info.height > max_y)
                 max_y = img_info.pos_y + img_info.height;
         }
-    }
+    );
 
     int width = max_x - min_x;
     int height = max_y - min_y;
 
-    printf("Allocating image memory...\n");
-    ns::Image img(width, height, false);
+    ns::Compositor compositor(width, height, COMPOSITE_MEMORY_BUDGET, &g_thread_pool);
+    compositor.set_bit_depth(COMPOSITE_BIT_DEPTH);
 
-
-    printf("Combining images...\n");
-    for (int id_x = 0; id_x < (int)g_image_info.size(); ++id_x)
+    if (COMPOSITE_USE_MAPPED_CANVAS)
     {
-        for (int id_y = 0; id_y < (int)g_image_info[0].size(); ++id_y)
-        {
-            printf("\e[0E[%lu/%lu]", id_x * g_image_info[0].size() + id_y, g_image_info.size() * g_image_info[0].size());
-            fflush(stdout);
-
-            auto& sub_img_info = g_image_info[id_x][id_y];
-
-            if (!sub_img_info.has_been_adjusted || sub_img_info.ignore)
-                continue;
-
-            auto sub_img_id = load_image(id_x, id_y, false, false);
-            auto sub_img = get_img_ext_from_id(sub_img_id);
-
-            if (!sub_img)
-            {
-                printf("Unable to get image %d/%d\n", id_x, id_y);
-                continue;
-            }
-
-            for (int x = 0; x < sub_img_info.width; ++x)
-            {
-                for (int y = 0; y < sub_img_info.height; ++y)
-                {
-                    int img_x = sub_img_info.pos_x + x - min_x;
-                    int img_y = sub_img_info.pos_y + y - min_y;
+        std::filesystem::path canvas_path = g_capture_dir;
+        canvas_path.replace_filename(canvas_path.filename().generic_string() + ".canvas");
+        compositor.set_canvas_path(canvas_path);
+    }
+    std::vector<size_t> source_slots;
 
-                    auto sub_c = sub_img->img.get_pixel(x, y);
-                    auto img_c = img.get_pixel(img_x, img_y);
+    for (size_t slot = 0; slot < g_image_grid.size(); ++slot)
+    {
+        auto sub_img_info = g_image_grid.get_info(slot);
 
-                    img_c.r += sub_c.r;
-                    img_c.g += sub_c.g;
-                    img_c.b += sub_c.b;
-                    img_c.a += 1.0f;
+        if (!sub_img_info.has_been_adjusted || sub_img_info.ignore)
+            continue;
 
-                    img.put_pixel(img_c, img_x, img_y);
-                }
-            }
-        }
+        compositor.add_source(sub_img_info.pos_x - min_x, sub_img_info.pos_y - min_y, sub_img_info.width, sub_img_info.height);
+        source_slots.push_back(slot);
     }
 
-    printf("Cleaning up image...\n");
-    for (int x = 0; x < width; ++x)
+    // Sources bypass the image cache, so their pixels are freed as soon as the compositor releases them.
+    // A missing source fails the render instead of leaving a hole in the image. Called from the pool threads.
+    auto load_source = [&](size_t source_index, ns::Image& img)
     {
-        for (int y = 0; y < height; ++y)
+        auto [id_x, id_y] = g_image_grid.get_id(source_slots[source_index]);
+        std::string filepath = g_capture_dir / get_filename_from_ids(id_x, id_y);
+
+        if (!ns::Image::can_load_from_file(filepath))
         {
-            ns::Color c = img.get_pixel(x, y);
+            printf("Unable to load image %d/%d from %s\n", id_x, id_y, filepath.c_str());
+            return false;
+        }
 
-            c.r /= c.a;
-            c.g /= c.a;
-            c.b /= c.a;
+        img = ns::Image::load_from_file(filepath, false);
+        return true;
+    };
 
-            img.put_pixel(c, x, y);
-        }
-    }
+    // Mosaics that fit into memory are saved as JPEG, larger or 16 bit ones are streamed to a PPM file
+    bool use_jpg = compositor.can_write_jpg();
 
     std::filesystem::path filepath = g_capture_dir;
-    filepath.replace_filename(filepath.filename().generic_string() + ".jpg");
+    filepath.replace_filename(filepath.filename().generic_string() + (use_jpg ? ".jpg" : ".ppm"));
 
     printf("Saving image to file %s...\n", filepath.c_str());
-    if (!img.save_to_file(filepath))
+    bool success = use_jpg ? compositor.write_jpg(filepath, load_source) : compositor.write_ppm(filepath, load_source);
+    if (!success)
         printf("Could not save image\n");
     else
         printf("DONE!\n");
@@ -575,6 +931,7 @@ void render_final_image()
 void init_image_info()
 {
     int max_id_x = 0, max_id_y = 0;
+    std::vector<ImageID> ids;
 
     for (auto it = std::filesystem::directory_iterator(g_capture_dir); it != std::filesystem::directory_iterator(); ++it)
     {
@@ -589,23 +946,50 @@ void init_image_info()
             max_id_x = id_x;
         if (id_y > max_id_y)
             max_id_y = id_y;
+
+        ids.push_back({ id_x, id_y });
+    }
+
+    // Irregular captures with missing images only get slots for the images present
+    if (ids.size() < (size_t)(max_id_x + 1) * (max_id_y + 1))
+    {
+        printf("Capture is missing %lu images, using a sparse grid\n", (size_t)(max_id_x + 1) * (max_id_y + 1) - ids.size());
+        g_image_grid = ns::ImageGrid(max_id_x + 1, max_id_y + 1, std::move(ids));
+    }
+    else
+    {
+        g_image_grid = ns::ImageGrid(max_id_x + 1, max_id_y + 1);
     }
 
-    g_image_info.resize(max_id_x + 1, std::vector<ImageInfo>(max_id_y + 1, ImageInfo{}));
+    init_image_slots();
+
+    // The first image is the reference all others are aligned to
+    if (g_image_grid.size() > 0)
+        g_image_grid.at_slot(0).has_been_adjusted = true;
 
-    g_image_info[0][0].has_been_adjusted = true;
+    rebuild_img_index();
 }
 
-void render_image(const ImageExt& img_ext, const ImageInfo& img_info, float opacity, bool has_border, ns::Color border_color)
+// Created on first use by the render thread
+ns::ImageRenderer& get_image_renderer()
 {
     static ns::ImageRenderer s_image_renderer;
+    return s_image_renderer;
+}
 
-    s_image_renderer.render(img_ext.img, img_info.pos_x, img_info.pos_y, g_camera, opacity, has_border, border_color);
+void render_image(const ImageExt& img_ext, const ImageInfo& img_info, float opacity, bool has_border, ns::Color border_color)
+{
+    get_image_renderer().add(img_ext.img, img_info.pos_x, img_info.pos_y, opacity, has_border, border_color);
+}
+
+void render_border(const ImageInfo& img_info, ns::Color border_color)
+{
+    get_image_renderer().add_border(img_info.pos_x, img_info.pos_y, img_info.width, img_info.height, border_color);
 }
 
 void render_image(const ImageExt& img_ext, float opacity, bool has_border, ns::Color border_color)
 {
-    auto& img_info = get_img_info_from_ext(img_ext);
+    auto img_info = get_img_info_from_ext(img_ext);
     render_image(img_ext, img_info, opacity, has_border, border_color);
 }
 
@@ -621,113 +1005,1259 @@ void render_image(const ImageID& img_id, float opacity, bool has_border, ns::Col
     render_image(*img_ext, opacity, has_border, border_color);
 }
 
-float calculate_diff_rect(int off_x, int off_y, int step_size, bool update_image_overlap)
+// Immutable snapshot of everything an alignment reads: the target image, its bases with
+// their positions at snapshot time and handles keeping all pixels alive. Alignments only
+// read their context, so several images can be aligned concurrently.
+// Contexts are only created with all handles set.
+struct AlignmentContext
 {
-    (void)update_image_overlap;
-    //Rect rect_combined = get_overlap_rect(off_x, off_y);
+    struct Base
+    {
+        ImageID img_id;
+        ImageInfo img_info;
+        ImageHandle img;
+    };
+public:
+    ImageID img_id;
+    ImageInfo img_info;
+    ImageHandle img;
+    std::vector<Base> bases;
+};
 
-    //if (update_image_overlap)
-    //{
-    //    g_image_overlap_info.pos_x = rect_combined.x;
-    //    g_image_overlap_info.pos_y = rect_combined.y;
-    //
-    //    g_image_overlap.img = std::make_shared<ns::Image>(rect_combined.w, rect_combined.h);
-    //}
+// Returns nullptr if an image is missing, aligning against a partial context would converge on a wrong position
+std::shared_ptr<const AlignmentContext> make_alignment_context(const ImageID& img_id, const ImageHandle& img, const std::map<ImageID, ImageHandle>& img_bases)
+{
+    if (!img)
+    {
+        printf("Cannot align image %d/%d, it is not loaded\n", img_id.x, img_id.y);
+        return nullptr;
+    }
+
+    for (auto& [img_base_id, img_base] : img_bases)
+    {
+        if (!img_base)
+        {
+            printf("Cannot align image %d/%d, base %d/%d is not loaded\n", img_id.x, img_id.y, img_base_id.x, img_base_id.y);
+            return nullptr;
+        }
+    }
+
+    auto ctx = std::make_shared<AlignmentContext>();
+
+    // Positions are published under g_alignment_mtx
+    std::lock_guard lock(g_alignment_mtx);
+
+    ctx->img_id = img_id;
+    ctx->img_info = get_img_info_from_id(img_id);
+    ctx->img = img;
+
+    for (auto& [img_base_id, img_base] : img_bases)
+    {
+        if (img_base_id == img_id)
+            continue;
+
+        ctx->bases.push_back({ img_base_id, get_img_info_from_id(img_base_id), img_base });
+    }
+
+    return ctx;
+}
+
+// Uses the images currently loaded, for threads that do not load them themselves
+std::shared_ptr<const AlignmentContext> make_alignment_context(const ImageID& img_id, const std::set<ImageID>& img_base_ids)
+{
+    std::map<ImageID, ImageHandle> img_bases;
+    for (auto& img_base_id : img_base_ids)
+        img_bases[img_base_id] = get_img_ext_from_id(img_base_id);
+
+    return make_alignment_context(img_id, get_img_ext_from_id(img_id), img_bases);
+}
+
+float calculate_diff_rect(const AlignmentContext& ctx, int pos_x, int pos_y, int step_size, bool update_image_overlap)
+{
+    (void)update_image_overlap;
+    //Rect rect_combined = get_overlap_rect(off_x, off_y);
+
+    //if (update_image_overlap)
+    //{
+    //    g_image_overlap_info.pos_x = rect_combined.x;
+    //    g_image_overlap_info.pos_y = rect_combined.y;
+    //
+    //    g_image_overlap.img = std::make_shared<ns::Image>(rect_combined.w, rect_combined.h);
+    //}
+
+    auto& img_curr = ctx.img;
+
+    Rect img_curr_rect = get_rect_from_img_info(ctx.img_info);
+    img_curr_rect.x = pos_x;
+    img_curr_rect.y = pos_y;
+    
+    float size_combined = 0.0f;
+    float diff_score_combined = 0.0f;
+
+    for (auto& base : ctx.bases)
+    {
+        auto& img_base = base.img;
+        auto& img_info_base = base.img_info;
+
+        Rect rect = get_overlap_rect(img_curr_rect, img_info_base);
+        if (rect.w <= 0 || rect.h <= 0)
+            continue;
+
+        float diff_score = 0.0f;
+
+        for (int y = 0; y < rect.h; y += step_size)
+        {
+            for (int x = 0; x < rect.w; x += step_size)
+            {
+                int base_x = rect.x - img_info_base.pos_x + x;
+                int base_y = rect.y - img_info_base.pos_y + y;
+                ns::Color c_base = img_base->img.get_pixel(base_x, base_y);
+                int curr_x = rect.x - pos_x + x;
+                int curr_y = rect.y - pos_y + y;
+                ns::Color c_curr = img_curr->img.get_pixel(curr_x, curr_y);
+
+                //float diff = std::abs((c_base.r + c_base.g + c_base.b) - (c_curr.r + c_curr.g + c_curr.b)) / 3.0f;
+                float diff = std::abs(c_base.a - c_curr.a);
+
+                //if (update_image_overlap)
+                //    g_image_overlap.img.put_pixel({ diff, diff, diff }, x, y);
+
+                diff_score += diff;
+            }
+        }
+
+        size_combined += rect.w * rect.h / step_size / step_size;
+        diff_score_combined += diff_score;
+    }
+
+    diff_score_combined /= size_combined;
+
+    return diff_score_combined;
+}
+
+std::vector<ImageID> find_base_candidates(const ImageID& img_id, const Rect& rect)
+{
+    ns::SpatialIndex::Rect query_rect = { rect.x, rect.y, rect.w, rect.h };
+
+    // Any image within distance has its top left corner inside the square around the position
+    if (g_max_image_use_distance_enabled)
+    {
+        int dist = (int)std::ceil(std::sqrt((float)g_max_image_use_distance));
+        query_rect = { rect.x - dist, rect.y - dist, dist * 2 + 1, dist * 2 + 1 };
+    }
+
+    std::vector<ImageID> candidates;
+
+    for (size_t key : g_image_index.query_rect(query_rect))
+    {
+        ImageID candidate_id = get_img_id_from_index_key(key);
+        auto img_info = get_img_info_from_id(candidate_id);
+
+        // Skip image itself
+        if (img_id == candidate_id)
+            continue;
+
+        // Skip untouched images
+        if (!img_info.has_been_adjusted)
+            continue;
+
+        // Skip ignored images
+        if (img_info.ignore)
+            continue;
+
+        // Skip out of bounds images
+        if (g_max_image_use_distance_enabled)
+        {
+            int dx = img_info.pos_x - rect.x;
+            int dy = img_info.pos_y - rect.y;
+            if (dx*dx + dy*dy > g_max_image_use_distance)
+                continue;
+        }
+        else
+        {
+            Rect overlap_rect = get_overlap_rect(rect, img_info);
+            if (overlap_rect.w <= 0 || overlap_rect.h <= 0)
+                continue;
+        }
+
+        candidates.push_back(candidate_id);
+    }
+
+    return candidates;
+}
+
+// Loads the bases for aligning image img_id at position pos_x/pos_y, with the handles returned while loading
+std::map<ImageID, ImageHandle> load_alignment_bases(const ImageID& img_id, int pos_x, int pos_y)
+{
+    Rect rect = get_rect_from_img_info(get_img_info_from_id(img_id));
+    rect.x = pos_x;
+    rect.y = pos_y;
+
+    std::map<ImageID, ImageHandle> img_bases;
+    for (auto& img_base_id : find_base_candidates(img_id, rect))
+        img_bases[img_base_id] = load_image(img_base_id.x, img_base_id.y, false);
+
+    // Load default image base
+    ImageID ref_id = get_reference_id();
+    if (img_bases.empty() && !(img_id == ref_id))
+        img_bases[ref_id] = load_image(ref_id.x, ref_id.y, false);
+
+    return img_bases;
+}
+
+ImageID get_following_id(ImageID img_id)
+{
+    if (g_image_grid.size() < 2)
+        return img_id;
+
+    // Slots missing from a sparse grid are skipped
+    do
+    {
+        if (++img_id.x >= g_image_grid.get_size_x())
+        {
+            img_id.x = 0;
+
+            if (++img_id.y >= g_image_grid.get_size_y())
+            {
+                // Last image reached, generate result and store on disk.
+                img_id = { 0, 0 };
+            }
+        }
+    } while (!g_image_grid.contains(img_id) || img_id == get_reference_id());
+
+    return img_id;
+}
+
+ImageID get_preceding_id(ImageID img_id)
+{
+    if (g_image_grid.size() < 2)
+        return img_id;
+
+    // Slots missing from a sparse grid are skipped, as is the reference image
+    do
+    {
+        if (--img_id.x < 0)
+        {
+            img_id.x = g_image_grid.get_size_x() - 1;
+
+            if (--img_id.y < 0)
+                img_id.y = g_image_grid.get_size_y() - 1;
+        }
+    } while (!g_image_grid.contains(img_id) || img_id == get_reference_id());
+
+    return img_id;
+}
+
+// Average position difference between adjusted images whose ids differ by step_id_x/step_id_y
+std::optional<std::pair<float, float>> get_avg_step(int step_id_x, int step_id_y)
+{
+    float sum_x = 0.0f, sum_y = 0.0f;
+    int count = 0;
+
+    for (size_t slot = 0; slot < g_image_grid.size(); ++slot)
+    {
+        auto img_id = g_image_grid.get_id(slot);
+        size_t slot_2 = g_image_grid.find({ img_id.x + step_id_x, img_id.y + step_id_y });
+        if (slot_2 == ns::ImageGrid::npos)
+            continue;
+
+        auto img_info_1 = g_image_grid.get_info(slot);
+        auto img_info_2 = g_image_grid.get_info(slot_2);
+
+        if (!img_info_1.has_been_adjusted || img_info_1.ignore ||
+            !img_info_2.has_been_adjusted || img_info_2.ignore)
+            continue;
+
+        sum_x += img_info_2.pos_x - img_info_1.pos_x;
+        sum_y += img_info_2.pos_y - img_info_1.pos_y;
+        ++count;
+    }
+
+    if (!count)
+        return {};
+
+    return std::make_pair(sum_x / count, sum_y / count);
+}
+
+// Predicts the position of an image from its adjusted neighbours (or the current image, if there are none)
+// and the average step vectors between adjusted neighbours
+std::pair<int, int> predict_position(const ImageID& img_id, std::pair<float, float> step_x, std::pair<float, float> step_y)
+{
+    std::vector<ImageID> anchor_ids;
+    for (auto [dx, dy] : { std::make_pair(-1, 0), std::make_pair(1, 0), std::make_pair(0, -1), std::make_pair(0, 1) })
+    {
+        ImageID anchor_id = { img_id.x + dx, img_id.y + dy };
+
+        if (!g_image_grid.contains(anchor_id))
+            continue;
+
+        auto anchor_info = get_img_info_from_id(anchor_id);
+        if (anchor_info.has_been_adjusted && !anchor_info.ignore)
+            anchor_ids.push_back(anchor_id);
+    }
+
+    if (anchor_ids.empty())
+        anchor_ids.push_back(g_image_current_id);
+
+    float pos_x = 0.0f, pos_y = 0.0f;
+    for (auto& anchor_id : anchor_ids)
+    {
+        auto anchor_info = get_img_info_from_id(anchor_id);
+        int steps_x = img_id.x - anchor_id.x;
+        int steps_y = img_id.y - anchor_id.y;
+        pos_x += anchor_info.pos_x + steps_x * step_x.first + steps_y * step_y.first;
+        pos_y += anchor_info.pos_y + steps_x * step_x.second + steps_y * step_y.second;
+    }
+
+    return { (int)std::round(pos_x / anchor_ids.size()), (int)std::round(pos_y / anchor_ids.size()) };
+}
+
+std::pair<int, int> predict_position(const ImageID& img_id)
+{
+    auto step_x = get_avg_step(1, 0).value_or(std::make_pair(0.0f, 0.0f));
+    auto step_y = get_avg_step(0, 1).value_or(std::make_pair(0.0f, 0.0f));
+
+    return predict_position(img_id, step_x, step_y);
+}
+
+struct AlignmentSearch
+{
+    std::shared_ptr<const AlignmentContext> ctx;
+    int pos_x, pos_y;
+    bool high_priority;
+    // Best diff score of the last step and how distinct it is from the other tested offsets
+    float diff_score = std::numeric_limits<float>::quiet_NaN();
+    float confidence = 0.0f;
+    std::function<bool ()> is_cancelled;
+    // Publishes a new position, returns false if the search has been cancelled meanwhile
+    std::function<bool (int, int)> publish_pos;
+};
+
+// Returns whether the image has been moved, std::nullopt if the search has been cancelled
+std::optional<bool> move_to_best_diff_score(AlignmentSearch& search, int test_range, int step_size)
+{
+    printf("Testing for best diff score of image %d/%d in range %d...\n", search.ctx->img_id.x, search.ctx->img_id.y, test_range);
+
+    int test_width = test_range * 2 + 1;
+
+    std::vector<std::vector<float>> diff_scores(test_width, std::vector<float>(test_width, 0.0f));
+
+    ns::parallel_for(
+        g_thread_pool, 0, test_width * test_width, 1,
+        [&](int64_t begin, int64_t end)
+        {
+            for (int64_t i = begin; i < end && !search.is_cancelled(); ++i)
+            {
+                int id_x = i / test_width;
+                int id_y = i % test_width;
+                int pos_x = search.pos_x + id_x - test_range;
+                int pos_y = search.pos_y + id_y - test_range;
+                diff_scores[id_x][id_y] = calculate_diff_rect(*search.ctx, pos_x, pos_y, step_size, false);
+            }
+        },
+        search.high_priority
+    );
+
+    int best_off_x = 0, best_off_y = 0;
+    float best_diff_score = 1.1f;
+
+    for (int off_x = -test_range; off_x <= test_range; ++off_x)
+    {
+        for (int off_y = -test_range; off_y <= test_range; ++off_y)
+        {
+            int id_x = off_x + test_range;
+            int id_y = off_y + test_range;
+            float diff_score = diff_scores[id_x][id_y];
+
+            if (diff_score < best_diff_score)
+            {
+                best_diff_score = diff_score;
+                best_off_x = off_x;
+                best_off_y = off_y;
+            }
+        }
+    }
+
+    if (search.is_cancelled() || !search.publish_pos(search.pos_x + best_off_x, search.pos_y + best_off_y))
+        return {};
+
+    float sum_others = 0.0f;
+    int n_others = 0;
+    for (int id_x = 0; id_x < test_width; ++id_x)
+    {
+        for (int id_y = 0; id_y < test_width; ++id_y)
+        {
+            float diff_score = diff_scores[id_x][id_y];
+            if ((id_x == best_off_x + test_range && id_y == best_off_y + test_range) || std::isnan(diff_score))
+                continue;
+
+            sum_others += diff_score;
+            ++n_others;
+        }
+    }
+
+    search.diff_score = best_diff_score;
+    search.confidence = n_others ? 1.0f - best_diff_score / (sum_others / n_others) : 0.0f;
+
+    search.pos_x += best_off_x;
+    search.pos_y += best_off_y;
+    
+    printf("  -> Diff score: %f -- off_x:%d off_y:%d\n", best_diff_score, best_off_x, best_off_y);
+
+    return best_off_x || best_off_y;
+}
+
+// Returns whether a local minimum has been reached, std::nullopt if the search has been cancelled
+std::optional<bool> move_to_local_minimum(AlignmentSearch& search, int test_range, int max_iter, int step_size)
+{
+    // Loops 'indefinitely', when max_iter <= 0
+    while (--max_iter != 0)
+    {
+        auto moved = move_to_best_diff_score(search, test_range, step_size);
+        if (!moved.has_value())
+            return {};
+        if (!moved.value())
+            break;
+    }
+
+    return max_iter != 0;
+}
+
+// With coarse_first set, a search on every second pixel runs first and
+// the full resolution search only runs if that one converged.
+std::optional<bool> align_image(AlignmentSearch& search, int test_range, bool coarse_first)
+{
+    std::optional<bool> reached_local_minimum = true;
+
+    if (coarse_first)
+        reached_local_minimum = move_to_local_minimum(search, test_range, MAX_ITER_TEST_LOCAL_MINIMUM, 2);
+
+    if (reached_local_minimum.value_or(false))
+        reached_local_minimum = move_to_local_minimum(search, test_range, MAX_ITER_TEST_LOCAL_MINIMUM, 1);
+
+    return reached_local_minimum;
+}
+
+// Marks the pair offsets of an image for re-measurement after it has been moved by hand
+void invalidate_pair_offsets(const ImageID& img_id)
+{
+    std::lock_guard lock(g_pair_offsets_mtx);
+
+    for (auto& [key, pair] : g_pair_offsets)
+        if (key.first == img_id || key.second == img_id)
+            pair.is_outdated = true;
+}
+
+// Must be called after anything visible changed (camera, positions, opacity, loaded images)
+void request_redraw()
+{
+    if (auto p_window = g_p_window.load())
+        p_window->invalidate();
+}
+
+void post_to_user_thread(ns::Task task)
+{
+    {
+        std::lock_guard lock(g_user_tasks_mtx);
+        g_user_tasks.push_back(std::move(task));
+    }
+
+    // Without a window (auto mode) there is no user thread, tasks are run on the next call of run_user_tasks
+    if (auto p_events = g_events.load())
+        p_events->wake();
+}
+
+void run_user_tasks()
+{
+    std::vector<ns::Task> tasks;
+    {
+        std::lock_guard lock(g_user_tasks_mtx);
+        tasks.swap(g_user_tasks);
+    }
+
+    for (auto& task : tasks)
+        task();
+
+    if (!tasks.empty())
+        request_redraw();
+}
+
+std::filesystem::path get_thumbnail_atlas_path()
+{
+    std::filesystem::path filepath = g_capture_dir;
+    filepath.replace_filename(filepath.filename().generic_string() + ".thumbs");
+
+    return filepath;
+}
+
+// Creates the thumbnails of all captures missing from the cached atlas, stops when the window closes.
+// Captures are read one after the other on a single pool thread, alignment keeps the others.
+void build_thumbnail_atlas()
+{
+    if (g_image_grid.size() == 0)
+        return;
+
+    auto is_stopped = []{ return g_events.load() == nullptr; };
+
+    // Unreadable captures are left without a thumbnail instead of failing the whole atlas
+    auto load_source = [](int id_x, int id_y, ns::Image& img)
+    {
+        std::string filepath = g_capture_dir / get_filename_from_ids(id_x, id_y);
+
+        if (!ns::Image::can_load_from_file(filepath))
+        {
+            printf("Unable to load image %d/%d from %s, skipping its thumbnail\n", id_x, id_y, filepath.c_str());
+            return false;
+        }
+
+        img = ns::Image::load_from_file(filepath, false, reverse_vignette);
+        return true;
+    };
+
+    // All captures share the size of the first readable one
+    size_t first_slot = 0;
+    ns::Image first_img;
+    while (first_slot < g_image_grid.size() && !is_stopped())
+    {
+        auto [id_x, id_y] = g_image_grid.get_id(first_slot);
+        if (load_source(id_x, id_y, first_img))
+            break;
+
+        ++first_slot;
+    }
+
+    if (first_slot == g_image_grid.size() || is_stopped())
+        return;
+
+    auto [first_id_x, first_id_y] = g_image_grid.get_id(first_slot);
+
+    auto p_atlas = std::make_shared<ns::ThumbnailAtlas>(
+        g_image_grid.get_size_x(), g_image_grid.get_size_y(), first_img.get_width(), first_img.get_height()
+    );
+
+    auto filepath = get_thumbnail_atlas_path();
+    if (p_atlas->load_from_file(filepath))
+        printf("Loaded %d thumbnails from %s\n", p_atlas->get_n_thumbnails(), filepath.c_str());
+
+    int n_created = 0;
+    if (!p_atlas->has_thumbnail(first_id_x, first_id_y))
+    {
+        p_atlas->set_thumbnail(first_id_x, first_id_y, first_img);
+        ++n_created;
+    }
+    first_img = ns::Image();
+
+    std::atomic_store(&g_p_thumbnail_atlas, std::shared_ptr<const ns::ThumbnailAtlas>(p_atlas));
+    request_redraw();
+
+    // Captures before the first readable one have been tried already
+    for (size_t slot = first_slot + 1; slot < g_image_grid.size() && !is_stopped(); ++slot)
+    {
+        auto [id_x, id_y] = g_image_grid.get_id(slot);
+        if (p_atlas->has_thumbnail(id_x, id_y))
+            continue;
+
+        ns::Image img;
+        if (!load_source(id_x, id_y, img))
+            continue;
+
+        p_atlas->set_thumbnail(id_x, id_y, img);
+        ++n_created;
+
+        request_redraw();
+    }
+
+    if (n_created > 0)
+    {
+        printf("Created %d thumbnails, %d/%lu in atlas\n", n_created, p_atlas->get_n_thumbnails(), g_image_grid.size());
+
+        if (!p_atlas->save_to_file(filepath))
+            printf("Unable to save thumbnails to %s\n", filepath.c_str());
+    }
+}
+
+bool alignment_is_cancelled(uint64_t generation)
+{
+    return g_alignment_generation != generation;
+}
+
+// Only way positions are written apart from the publishing of running alignments
+void move_image(const ImageID& img_id, int pos_x, int pos_y, bool has_been_adjusted)
+{
+    std::lock_guard lock(g_alignment_mtx);
+
+    auto img_info = get_img_info_from_id(img_id);
+    img_info.pos_x = pos_x;
+    img_info.pos_y = pos_y;
+    img_info.has_been_adjusted = has_been_adjusted;
+    update_img_index(img_id);
+}
+
+// Ignored images are never used as bases, toggling one counts as adjusting it.
+// The flags are read by the alignment workers, so like positions they are written under g_alignment_mtx.
+bool toggle_image_ignore(const ImageID& img_id)
+{
+    std::lock_guard lock(g_alignment_mtx);
+
+    auto img_info = get_img_info_from_id(img_id);
+    img_info.ignore = !img_info.ignore;
+    img_info.has_been_adjusted = true;
+    update_img_index(img_id);
+    return img_info.ignore;
+}
+
+// Invalidates any running alignment. Must be called before the current image is moved or switched.
+void cancel_alignment()
+{
+    std::lock_guard lock(g_alignment_mtx);
+
+    ++g_alignment_generation;
+    g_image_current_border_color = COLOR_GREY;
+}
+
+void cancel_speculation()
+{
+    std::lock_guard lock(g_speculation_mtx);
+
+    ++g_speculation_generation;
+    g_speculation.is_done = false;
+}
+
+// Aligns the image following the current one at low priority, starting at its predicted position.
+void start_speculation()
+{
+    ImageID img_id = get_following_id(g_image_current_id);
+
+    if (img_id == g_image_current_id || get_img_info_from_id(img_id).has_been_adjusted)
+        return;
+
+    auto [pred_x, pred_y] = predict_position(img_id);
+
+    uint64_t generation;
+    {
+        std::lock_guard lock(g_speculation_mtx);
+
+        generation = ++g_speculation_generation;
+        g_speculation = { img_id, pred_x, pred_y, false, false };
+    }
+
+    auto speculation_func = [img_id, pred_x = pred_x, pred_y = pred_y, generation]()
+    {
+        auto is_cancelled = [generation]{ return g_speculation_generation != generation; };
+
+        // Alignment only image, as viewable images cannot be created outside the render thread
+        auto img = load_image(img_id.x, img_id.y, false);
+
+        if (is_cancelled())
+            return;
+
+        AlignmentSearch search;
+        search.ctx = make_alignment_context(img_id, img, load_alignment_bases(img_id, pred_x, pred_y));
+        if (!search.ctx)
+            return;
+
+        search.pos_x = pred_x;
+        search.pos_y = pred_y;
+        search.high_priority = false;
+        search.is_cancelled = is_cancelled;
+        search.publish_pos = [generation](int pos_x, int pos_y)
+        {
+            std::lock_guard lock(g_speculation_mtx);
+
+            if (g_speculation_generation != generation)
+                return false;
+
+            g_speculation.pos_x = pos_x;
+            g_speculation.pos_y = pos_y;
+            return true;
+        };
+
+        auto reached_local_minimum = align_image(search, g_test_range, true);
+
+        std::lock_guard lock(g_speculation_mtx);
+
+        if (!reached_local_minimum.has_value() || is_cancelled())
+            return;
+
+        g_speculation.is_done = true;
+        g_speculation.reached_local_minimum = reached_local_minimum.value();
+
+        printf("Speculative alignment of image %d/%d done\n", img_id.x, img_id.y);
+    };
+
+    ns::push_task(g_thread_pool, speculation_func);
+}
+
+// Stops the speculation for img_id and returns its (possibly partial) result
+std::optional<Speculation> take_speculation(const ImageID& img_id)
+{
+    std::lock_guard lock(g_speculation_mtx);
+
+    if (!(g_speculation.img_id == img_id))
+        return {};
+
+    ++g_speculation_generation;
+
+    Speculation speculation = g_speculation;
+    g_speculation.img_id = { -1, -1 };
+    return speculation;
+}
+
+// Aligns the current image in the background
+void start_alignment(int test_range, bool coarse_first)
+{
+    uint64_t generation;
+    {
+        std::lock_guard lock(g_alignment_mtx);
+
+        generation = ++g_alignment_generation;
+        g_image_current_border_color = COLOR_YELLOW;
+    }
+
+    cancel_speculation();
+
+    ImageID img_id = g_image_current_id;
+    invalidate_pair_offsets(img_id);
+
+    auto img_info = get_img_info_from_id(img_id);
+    int pos_x = img_info.pos_x;
+    int pos_y = img_info.pos_y;
+
+    auto alignment_func = [img_id, pos_x, pos_y, test_range, coarse_first, generation]()
+    {
+        auto img = load_image(img_id.x, img_id.y, false);
+
+        AlignmentSearch search;
+        search.ctx = make_alignment_context(img_id, img, load_alignment_bases(img_id, pos_x, pos_y));
+        if (!search.ctx)
+        {
+            std::lock_guard lock(g_alignment_mtx);
+
+            if (!alignment_is_cancelled(generation))
+            {
+                g_image_current_border_color = COLOR_RED;
+                request_redraw();
+            }
+            return;
+        }
+
+        search.pos_x = pos_x;
+        search.pos_y = pos_y;
+        search.high_priority = true;
+        search.is_cancelled = [generation]{ return alignment_is_cancelled(generation); };
+        search.publish_pos = [img_id, generation](int pos_x, int pos_y)
+        {
+            std::lock_guard lock(g_alignment_mtx);
+
+            if (alignment_is_cancelled(generation))
+                return false;
+
+            auto img_info = get_img_info_from_id(img_id);
+            img_info.pos_x = pos_x;
+            img_info.pos_y = pos_y;
+            update_img_index(img_id);
+            request_redraw();
+            return true;
+        };
+
+        auto reached_local_minimum = align_image(search, test_range, coarse_first);
+
+        {
+            std::lock_guard lock(g_alignment_mtx);
+
+            if (!reached_local_minimum.has_value() || alignment_is_cancelled(generation))
+                return;
+
+            g_image_current_border_color = reached_local_minimum.value() ? COLOR_GREEN : COLOR_RED;
+            request_redraw();
+        }
+
+        post_to_user_thread(start_speculation);
+    };
+
+    ns::push_task(g_thread_pool, alignment_func, true);
+}
+
+// Images whose positions depend on the currently adjusted ones, i.e. the next level of the
+// dependency graph: unadjusted images with at least one adjusted (and not ignored) neighbour.
+std::vector<ImageID> get_auto_stitching_wave()
+{
+    std::vector<ImageID> wave;
+
+    for (size_t slot = 0; slot < g_image_grid.size(); ++slot)
+    {
+        if (g_image_grid.at_slot(slot).has_been_adjusted)
+            continue;
+
+        auto img_id = g_image_grid.get_id(slot);
+
+        for (auto [dx, dy] : { std::make_pair(-1, 0), std::make_pair(1, 0), std::make_pair(0, -1), std::make_pair(0, 1) })
+        {
+            size_t nb_slot = g_image_grid.find({ img_id.x + dx, img_id.y + dy });
+            if (nb_slot == ns::ImageGrid::npos)
+                continue;
+
+            auto nb_info = g_image_grid.at_slot(nb_slot);
+            if (nb_info.has_been_adjusted && !nb_info.ignore)
+            {
+                wave.push_back(img_id);
+                break;
+            }
+        }
+    }
+
+    return wave;
+}
+
+// Keeps the images of a batch and optionally their neighbours from being evicted, an empty batch unpins all images
+void pin_image_batch(const std::vector<ImageID>& batch, bool with_neighbours = true)
+{
+    std::unique_lock lock(g_images_mtx);
+
+    g_pinned_image_ids.clear();
+
+    for (auto& img_id : batch)
+    {
+        if (!with_neighbours)
+        {
+            g_pinned_image_ids.insert(img_id);
+            continue;
+        }
+
+        for (int dx = -1; dx <= 1; ++dx)
+        {
+            for (int dy = -1; dy <= 1; ++dy)
+            {
+                ImageID nb_id = { img_id.x + dx, img_id.y + dy };
+                if (g_image_grid.contains(nb_id))
+                    g_pinned_image_ids.insert(nb_id);
+            }
+        }
+    }
+}
+
+std::vector<std::pair<ImageID, ImageID>> find_overlapping_pairs()
+{
+    std::vector<std::pair<ImageID, ImageID>> pairs;
+
+    auto is_placed = [](const ImageInfo& img_info) { return img_info.has_been_adjusted && !img_info.ignore; };
+
+    for (size_t slot_a = 0; slot_a < g_image_grid.size(); ++slot_a)
+    {
+        auto img_info_a = g_image_grid.get_info(slot_a);
+        if (!is_placed(img_info_a))
+            continue;
+
+        auto img_id_a = g_image_grid.get_id(slot_a);
+
+        // Overlaps are only expected between grid neighbours, every pair is visited once
+        for (auto [dx, dy] : { std::make_pair(1, 0), std::make_pair(0, 1), std::make_pair(1, 1), std::make_pair(1, -1) })
+        {
+            ImageID img_id_b = { img_id_a.x + dx, img_id_a.y + dy };
+
+            size_t slot_b = g_image_grid.find(img_id_b);
+            if (slot_b == ns::ImageGrid::npos)
+                continue;
+
+            auto img_info_b = g_image_grid.get_info(slot_b);
+            if (!is_placed(img_info_b))
+                continue;
+
+            Rect overlap_rect = get_overlap_rect(get_rect_from_img_info(img_info_a), img_info_b);
+            if (overlap_rect.w <= 0 || overlap_rect.h <= 0 ||
+                overlap_rect.w * (float)overlap_rect.h < MIN_PAIR_OVERLAP * img_info_b.width * img_info_b.height)
+                continue;
+
+            pairs.push_back({ img_id_a, img_id_b });
+        }
+    }
+
+    return pairs;
+}
+
+PairOffset measure_pair_offset(const ImageID& img_id_a, const ImageID& img_id_b)
+{
+    auto img_a = load_image(img_id_a.x, img_id_a.y, false);
+    auto img_b = load_image(img_id_b.x, img_id_b.y, false);
+
+    PairOffset pair;
+    pair.img_id_a = img_id_a;
+    pair.img_id_b = img_id_b;
+    pair.metric = DiffMetric::AlphaAbsDiff;
+    pair.is_outdated = false;
+
+    AlignmentSearch search;
+    search.ctx = make_alignment_context(img_id_b, img_b, { { img_id_a, img_a } });
+    if (!search.ctx)
+    {
+        // Skipped by the solver
+        pair.off_x = 0;
+        pair.off_y = 0;
+        pair.reached_local_minimum = false;
+        pair.diff_score = std::numeric_limits<float>::quiet_NaN();
+        pair.confidence = 0.0f;
+        return pair;
+    }
+
+    // Start and offset both use the positions of the snapshot, which are consistent with each other
+    auto& img_info_a = search.ctx->bases[0].img_info;
+    search.pos_x = search.ctx->img_info.pos_x;
+    search.pos_y = search.ctx->img_info.pos_y;
+    search.high_priority = false;
+    search.is_cancelled = []{ return false; };
+    search.publish_pos = [](int, int){ return true; };
+
+    auto reached_local_minimum = align_image(search, g_test_range, true);
+
+    pair.off_x = search.pos_x - img_info_a.pos_x;
+    pair.off_y = search.pos_y - img_info_a.pos_y;
+    pair.reached_local_minimum = reached_local_minimum.value_or(false);
+    pair.diff_score = search.diff_score;
+    pair.confidence = search.confidence;
+
+    return pair;
+}
+
+std::vector<PairOffset> measure_pair_offsets(const std::vector<std::pair<ImageID, ImageID>>& pairs)
+{
+    // Each pair only needs and pins its two images. Half of the cache is left to the current image and
+    // its bases, which are loaded interactively while the batches run.
+    const size_t max_batch_size = std::max<size_t>(1, MAX_LOADED_IMAGES / 4);
+
+    std::vector<PairOffset> pair_offsets(pairs.size());
+
+    for (size_t batch_begin = 0; batch_begin < pairs.size(); batch_begin += max_batch_size)
+    {
+        size_t batch_end = std::min(batch_begin + max_batch_size, pairs.size());
+
+        std::vector<ImageID> batch;
+        for (size_t i = batch_begin; i < batch_end; ++i)
+        {
+            batch.push_back(pairs[i].first);
+            batch.push_back(pairs[i].second);
+        }
+        pin_image_batch(batch, false);
+
+        ns::parallel_for(
+            g_thread_pool, batch_begin, batch_end, 1,
+            [&](int64_t begin, int64_t end)
+            {
+                for (int64_t i = begin; i < end; ++i)
+                    pair_offsets[i] = measure_pair_offset(pairs[i].first, pairs[i].second);
+            }
+        );
+
+        printf("Measured %lu/%lu pair offsets\n", batch_end, pairs.size());
+    }
+
+    pin_image_batch({});
+
+    return pair_offsets;
+}
+
+// Places all adjusted images at once, so that the measured pair offsets are met best in the
+// weighted least-squares sense. Image 0/0 (or the first placed one) keeps its position.
+// The result is discarded if an image has been moved since generation was taken.
+void solve_positions(const std::vector<PairOffset>& pair_offsets, uint64_t generation)
+{
+    std::map<ImageID, size_t> nodes;
+    std::vector<ImageID> node_ids;
+
+    auto get_node = [&](const ImageID& img_id)
+    {
+        auto it = nodes.find(img_id);
+        if (it != nodes.end())
+            return it->second;
+
+        nodes.insert({ img_id, node_ids.size() });
+        node_ids.push_back(img_id);
+        return node_ids.size() - 1;
+    };
+
+    for (auto& pair : pair_offsets)
+    {
+        get_node(pair.img_id_a);
+        get_node(pair.img_id_b);
+    }
+
+    if (node_ids.empty())
+    {
+        printf("No overlapping images to optimize\n");
+        return;
+    }
+
+    ns::PositionSolver solver(node_ids.size());
+
+    for (size_t node = 0; node < node_ids.size(); ++node)
+    {
+        auto img_info = get_img_info_from_id(node_ids[node]);
+        solver.set_initial_pos(node, img_info.pos_x, img_info.pos_y);
+    }
+
+    auto it_origin = nodes.find(get_reference_id());
+    solver.fix_node(it_origin != nodes.end() ? it_origin->second : 0);
+
+    for (auto& pair : pair_offsets)
+    {
+        if (std::isnan(pair.diff_score))
+            continue;
+
+        float weight = std::clamp(pair.confidence, 0.01f, 1.0f);
+        if (!pair.reached_local_minimum)
+            weight = 0.01f;
+
+        solver.add_constraint(nodes[pair.img_id_a], nodes[pair.img_id_b], pair.off_x, pair.off_y, weight);
+    }
+
+    auto t_start = std::chrono::steady_clock::now();
+
+    bool converged = solver.solve();
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+
+    printf("Solved positions of %lu images in %.3f s (%d iterations, converged: %d, rms residual: %.2f px)\n",
+        node_ids.size(), seconds, solver.get_n_iterations(), (int)converged, solver.get_rms_residual());
+
+    std::lock_guard lock(g_alignment_mtx);
+
+    if (alignment_is_cancelled(generation))
+    {
+        printf("Images have been moved while optimizing, discarding the solved positions\n");
+        return;
+    }
+
+    for (size_t node = 0; node < node_ids.size(); ++node)
+    {
+        auto img_info = get_img_info_from_id(node_ids[node]);
+        img_info.pos_x = (int)std::round(solver.get_pos_x(node));
+        img_info.pos_y = (int)std::round(solver.get_pos_y(node));
+        update_img_index(node_ids[node]);
+    }
+
+    request_redraw();
+}
+
+// Only pairs that are new or outdated are measured, all others are taken from the pairwise graph.
+// Moving an image cancels the optimization (see cancel_alignment), it is not restarted.
+void optimize_positions()
+{
+    if (g_is_optimizing.exchange(true))
+    {
+        printf("Positions are already being optimized\n");
+        return;
+    }
+
+    uint64_t generation = g_alignment_generation;
+
+    printf("Optimizing positions globally...\n");
+
+    auto pairs = find_overlapping_pairs();
+
+    std::vector<std::pair<ImageID, ImageID>> pairs_to_measure;
+    {
+        std::lock_guard lock(g_pair_offsets_mtx);
+
+        for (auto& pair : pairs)
+        {
+            auto it = g_pair_offsets.find(pair);
+            if (it == g_pair_offsets.end() || it->second.is_outdated || it->second.metric != DiffMetric::AlphaAbsDiff)
+                pairs_to_measure.push_back(pair);
+        }
+    }
+
+    printf("Measuring offsets of %lu/%lu overlapping pairs...\n", pairs_to_measure.size(), pairs.size());
+
+    auto pair_offsets = measure_pair_offsets(pairs_to_measure);
+
+    {
+        std::lock_guard lock(g_pair_offsets_mtx);
+
+        for (auto& pair : pair_offsets)
+            g_pair_offsets[{ pair.img_id_a, pair.img_id_b }] = pair;
+
+        pair_offsets.clear();
+        for (auto& pair : pairs)
+            pair_offsets.push_back(g_pair_offsets[pair]);
+    }
+
+    solve_positions(pair_offsets, generation);
+
+    g_is_optimizing = false;
+}
+
+// Headless stitching of all images. Images are aligned wave by wave in parallel, every wave only
+// uses images of earlier waves as bases, so the result does not depend on the scheduling.
+void run_auto_stitching()
+{
+    struct AutoResult
+    {
+        int pos_x, pos_y;
+        bool reached_local_minimum;
+        float diff_score;
+        float confidence;
+    };
+
+    // Each image of a batch needs up to 9 images in memory
+    const size_t max_batch_size = std::max<size_t>(1, MAX_LOADED_IMAGES / 9);
+
+    printf("Stitching images automatically...\n");
+
+    auto t_start = std::chrono::steady_clock::now();
+
+    size_t n_aligned = 0;
+    std::vector<ImageID> review_ids;
+
+    std::vector<ImageID> wave;
+    while (!(wave = get_auto_stitching_wave()).empty())
+    {
+        auto step_x = get_avg_step(1, 0).value_or(std::make_pair(0.0f, 0.0f));
+        auto step_y = get_avg_step(0, 1).value_or(std::make_pair(0.0f, 0.0f));
+
+        std::vector<AutoResult> results(wave.size());
+
+        for (size_t batch_begin = 0; batch_begin < wave.size(); batch_begin += max_batch_size)
+        {
+            size_t batch_end = std::min(batch_begin + max_batch_size, wave.size());
+
+            pin_image_batch(std::vector<ImageID>(wave.begin() + batch_begin, wave.begin() + batch_end));
+
+            ns::parallel_for(
+                g_thread_pool, batch_begin, batch_end, 1,
+                [&](int64_t begin, int64_t end)
+                {
+                    for (int64_t i = begin; i < end; ++i)
+                    {
+                        auto& img_id = wave[i];
+                        auto [pred_x, pred_y] = predict_position(img_id, step_x, step_y);
+
+                        auto img = load_image(img_id.x, img_id.y, false);
+
+                        AlignmentSearch search;
+                        search.ctx = make_alignment_context(img_id, img, load_alignment_bases(img_id, pred_x, pred_y));
+                        if (!search.ctx)
+                        {
+                            // Left at the predicted position for review
+                            results[i] = { pred_x, pred_y, false, std::numeric_limits<float>::quiet_NaN(), 0.0f };
+                            continue;
+                        }
+
+                        search.pos_x = pred_x;
+                        search.pos_y = pred_y;
+                        search.high_priority = false;
+                        search.is_cancelled = []{ return false; };
+                        search.publish_pos = [](int, int){ return true; };
 
-    auto img_curr = get_img_ext_from_id(g_image_current_id);
-    if (!img_curr)
-    {
-        printf("Cannot calculate diff_rect for image %d/%d\n", g_image_current_id.x, g_image_current_id.y);
-        return 0.0f;
-    }
+                        auto reached_local_minimum = align_image(search, g_test_range, true);
 
-    auto& img_curr_info = get_img_info_from_id(g_image_current_id);
-    Rect img_curr_rect = get_rect_from_img_info(img_curr_info);
-    img_curr_rect.x += off_x;
-    img_curr_rect.y += off_y;
-    
-    float size_combined = 0.0f;
-    float diff_score_combined = 0.0f;
+                        results[i] = { search.pos_x, search.pos_y, reached_local_minimum.value_or(false), search.diff_score, search.confidence };
+                    }
+                }
+            );
+        }
 
-    for (auto& img_base_id : g_image_base_ids)
-    {
-        auto img_base = get_img_ext_from_id(img_base_id);
-        if (!img_base)
+        for (size_t i = 0; i < wave.size(); ++i)
         {
-            printf("Cannot calculate partial diff_rect for image %d/%d\n", img_base_id.x, img_base_id.y);
-            continue;
-        }
+            auto& result = results[i];
 
-        auto& img_info_base = get_img_info_from_id(img_base_id);
+            move_image(wave[i], result.pos_x, result.pos_y, true);
 
-        Rect rect = get_overlap_rect(img_curr_rect, img_info_base);
+            if (!result.reached_local_minimum || !(result.confidence >= MIN_AUTO_CONFIDENCE))
+            {
+                printf("Image %d/%d needs review (diff score: %f, confidence: %f, converged: %d)\n",
+                    wave[i].x, wave[i].y, result.diff_score, result.confidence, (int)result.reached_local_minimum);
+                review_ids.push_back(wave[i]);
+            }
+        }
 
-        float diff_score = 0.0f;
+        n_aligned += wave.size();
+    }
 
-        for (int y = 0; y < rect.h; y += step_size)
-        {
-            for (int x = 0; x < rect.w; x += step_size)
-            {
-                int base_x = rect.x - img_info_base.pos_x + x;
-                int base_y = rect.y - img_info_base.pos_y + y;
-                ns::Color c_base = img_base->img.get_pixel(base_x, base_y);
-                int curr_x = rect.x - img_curr_info.pos_x - off_x + x;
-                int curr_y = rect.y - img_curr_info.pos_y - off_y + y;
-                ns::Color c_curr = img_curr->img.get_pixel(curr_x, curr_y);
+    // Images cut off from the adjusted ones by ignored or missing captures are never part of a wave
+    size_t n_unreached = 0;
+    for (size_t slot = 0; slot < g_image_grid.size(); ++slot)
+    {
+        if (g_image_grid.at_slot(slot).has_been_adjusted)
+            continue;
 
-                //float diff = std::abs((c_base.r + c_base.g + c_base.b) - (c_curr.r + c_curr.g + c_curr.b)) / 3.0f;
-                float diff = std::abs(c_base.a - c_curr.a);
+        review_ids.push_back(g_image_grid.get_id(slot));
+        ++n_unreached;
+    }
 
-                //if (update_image_overlap)
-                //    g_image_overlap.img.put_pixel({ diff, diff, diff }, x, y);
+    if (n_unreached > 0)
+        printf("%lu images could not be reached from the adjusted ones and are marked for review\n", n_unreached);
 
-                diff_score += diff;
-            }
-        }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
 
-        size_combined += rect.w * rect.h / step_size / step_size;
-        diff_score_combined += diff_score;
+    {
+        std::lock_guard lock(g_review_ids_mtx);
+        g_review_ids.insert(review_ids.begin(), review_ids.end());
     }
 
-    diff_score_combined /= size_combined;
+    pin_image_batch({});
 
-    return diff_score_combined;
+    printf("Stitched %lu images in %.1f s (%.2f frames/s), %lu marked for review\n",
+        n_aligned, seconds, seconds > 0.0 ? n_aligned / seconds : 0.0, review_ids.size());
+
+    optimize_positions();
+
+    save_project_to_file();
 }
 
 void update_images()
 {
     ns::Image::delete_pending_tex_objs();
 
+    if (g_image_grid.size() == 0)
+        return;
+
+    // Sparse grids lack some ids, e.g. the default one or one stored in an older project file
+    if (!g_image_grid.contains(g_next_id))
+    {
+        printf("Image %d/%d is not part of the capture, continuing with the first image\n", g_next_id.x, g_next_id.y);
+        g_next_id = get_following_id(get_reference_id());
+    }
+
     if (g_next_id.x != g_image_current_id.x || g_next_id.y != g_image_current_id.y)
     {
-        int new_x, new_y;
-        {
-            auto& img_curr_info = get_img_info_from_id(g_image_current_id);
-            new_x = img_curr_info.pos_x;
-            new_y = img_curr_info.pos_y;
-        }
+        load_image(g_next_id.x, g_next_id.y);
+        g_image_current_id = g_next_id;
+
+        g_image_current_border_color = COLOR_GREY;
 
-        g_image_current_id = load_image(g_next_id.x, g_next_id.y);
+        // Take over speculative alignment or predict position if image has never been adjusted
+        auto speculation = take_speculation(g_image_current_id);
 
-        // Predict position if image has never been adjusted
+        auto img_info_curr = get_img_info_from_id(g_image_current_id);
+        if (!img_info_curr.has_been_adjusted)
         {
-            auto& img_info_curr = get_img_info_from_id(g_image_current_id);
-            if (!img_info_curr.has_been_adjusted)
+            auto [new_x, new_y] = predict_position(g_image_current_id);
+            bool has_been_adjusted = false;
+
+            if (speculation.has_value())
             {
-                img_info_curr.pos_x = new_x;
-                img_info_curr.pos_y = new_y;
+                new_x = speculation->pos_x;
+                new_y = speculation->pos_y;
 
-                g_image_current_init_x = new_x;
-                g_image_current_init_y = new_y;
+                if (speculation->is_done)
+                {
+                    has_been_adjusted = true;
+                    g_image_current_border_color = speculation->reached_local_minimum ? COLOR_GREEN : COLOR_RED;
+                }
             }
-        }
 
-        g_image_current_border_color = COLOR_GREY;
+            move_image(g_image_current_id, new_x, new_y, has_been_adjusted);
+
+            g_image_current_init_x = new_x;
+            g_image_current_init_y = new_y;
+
+            if (has_been_adjusted)
+                start_speculation();
+        }
     }
 
     static int prev_x = -1;
     static int prev_y = -1;
-    auto& img_info_curr = get_img_info_from_id(g_image_current_id);
+    auto img_info_curr = get_img_info_from_id(g_image_current_id);
     Rect rect_curr = get_rect_from_img_info(img_info_curr);
 
     if (prev_x != img_info_curr.pos_x || prev_y != img_info_curr.pos_y)
@@ -735,90 +2265,132 @@ void update_images()
         prev_x = img_info_curr.pos_x;
         prev_y = img_info_curr.pos_y;
 
+        // The eviction of other threads reads the bases, so they are changed under the lock.
+        // Images are loaded without it, load_image takes it itself.
+        std::set<ImageID> img_base_ids = g_image_base_ids;
+
         // Remove out of bounds bases
-        auto it = g_image_base_ids.begin();
-        while (it != g_image_base_ids.end())
+        auto it = img_base_ids.begin();
+        while (it != img_base_ids.end())
         {
             auto curr = it++;
 
             if (*curr == g_image_current_id)
             {
-                g_image_base_ids.erase(curr);
+                img_base_ids.erase(curr);
                 continue;
             }
 
             if (g_max_image_use_distance_enabled)
             {
                 if (get_img_dist(g_image_current_id, *curr) > g_max_image_use_distance)
-                    g_image_base_ids.erase(curr);
+                    img_base_ids.erase(curr);
             }
             else
             {
-                auto& img_info = get_img_info_from_id(*curr);
+                auto img_info = get_img_info_from_id(*curr);
                 Rect overlap_rect = get_overlap_rect(rect_curr, img_info);
                 if (overlap_rect.w <= 0 || overlap_rect.h <= 0)
-                    g_image_base_ids.erase(curr);
+                    img_base_ids.erase(curr);
             }
         }
 
-        // Load in-bounds bases
-        for (int id_x = 0; id_x < (int)g_image_info.size(); ++id_x)
+        // Load in-bounds bases, bases evicted in the meantime are loaded again
+        for (auto& img_base_id : find_base_candidates(g_image_current_id, rect_curr))
         {
-            for (int id_y = 0; id_y < (int)g_image_info[0].size(); ++id_y)
-            {
-                auto& img_info = g_image_info[id_x][id_y];
-
-                // Skip current image
-                if (g_image_current_id == ImageID{ id_x, id_y })
-                    continue;
-
-                // Skip untouched images
-                if (!img_info.has_been_adjusted)
-                    continue;
-
-                // Skip ignored images
-                if (img_info.ignore)
-                    continue;
-
-                // Skip images already in use
-                if (g_image_base_ids.find(ImageID{ id_x, id_y }) != g_image_base_ids.end())
-                    continue;
-
-                // Skip out of bounds images
-                if (g_max_image_use_distance_enabled)
-                {
-                    if (get_img_dist(g_image_current_id, { id_x, id_y }) > g_max_image_use_distance)
-                        continue;
-                }
-                else
-                {
-                    Rect overlap_rect = get_overlap_rect(rect_curr, img_info);
-                    if (overlap_rect.w <= 0 || overlap_rect.h <= 0)
-                        continue;
-                }
+            // Skip images already in use
+            if (img_base_ids.find(img_base_id) != img_base_ids.end() && is_img_loaded(img_base_id))
+                continue;
 
-                g_image_base_ids.insert(load_image(id_x, id_y));
-            }
+            load_image(img_base_id.x, img_base_id.y);
+            img_base_ids.insert(img_base_id);
         }
 
         // Load default image base
-        if (g_image_base_ids.empty())
-            g_image_base_ids.insert(load_image(0, 0));
+        if (img_base_ids.empty())
+        {
+            ImageID ref_id = get_reference_id();
+            load_image(ref_id.x, ref_id.y);
+            img_base_ids.insert(ref_id);
+        }
+
+        std::unique_lock lock(g_images_mtx);
+        g_image_base_ids = std::move(img_base_ids);
     }
 
     if (g_view_image_overlap)
     {
         if (image_overlap_is_outdated())
         {
-            float diff_score = calculate_diff_rect(0, 0, true, 1);
+            if (auto ctx = make_alignment_context(g_image_current_id, g_image_base_ids))
+            {
+                float diff_score = calculate_diff_rect(*ctx, img_info_curr.pos_x, img_info_curr.pos_y, 1, true);
 
-            printf("Diff score: %f\n", diff_score);
+                printf("Diff score: %f\n", diff_score);
+            }
         }
     }
 }
 
+ns::SpatialIndex::Rect get_visible_index_rect()
+{
+    float view_x, view_y, view_width, view_height;
+    ns::ImageRenderer::get_visible_rect(g_camera, view_x, view_y, view_width, view_height);
+
+    return {
+        (int)std::floor(view_x), (int)std::floor(view_y),
+        (int)std::ceil(view_width) + 1, (int)std::ceil(view_height) + 1
+    };
+}
+
+// Whether the thumbnails have at least as many texels as the full images would get on screen
+bool is_overview_zoom()
+{
+    auto p_atlas = std::atomic_load(&g_p_thumbnail_atlas);
+    if (!p_atlas)
+        return false;
+
+    int level = get_image_renderer().get_texture_level(p_atlas->get_capture_width(), p_atlas->get_capture_height());
+
+    return level >= p_atlas->get_level();
+}
+
+// Thumbnails of all adjusted images in view, drawn from the atlas in one call. At overview zoom
+// they replace the full images, closer in they stand in for images that are not loaded.
+void render_thumbnails()
+{
+    auto p_atlas = std::atomic_load(&g_p_thumbnail_atlas);
+    if (!p_atlas)
+        return;
+
+    auto& renderer = get_image_renderer();
+    bool is_overview = is_overview_zoom();
+
+    for (size_t slot : g_image_index.query_rect(get_visible_index_rect()))
+    {
+        auto [id_x, id_y] = g_image_grid.get_id(slot);
+        auto info = g_image_grid.get_info(slot);
+
+        // The current image is moved around, it is always drawn in full
+        if (!info.has_been_adjusted || ImageID{ id_x, id_y } == g_image_current_id || !p_atlas->has_thumbnail(id_x, id_y))
+            continue;
+
+        // Bases drawn in full would be blended with their thumbnails when transparent
+        if (!is_overview && g_image_base_ids.find(ImageID{ id_x, id_y }) != g_image_base_ids.end() && is_img_loaded({ id_x, id_y }))
+            continue;
+
+        float uv[4];
+        p_atlas->get_cell_uv(id_x, id_y, uv);
+
+        renderer.add_region(p_atlas->get_image(), uv, info.pos_x, info.pos_y, info.width, info.height, 1.0f);
+    }
+}
+
 void render_images_base()
 {
+    if (is_overview_zoom())
+        return;
+
     for (auto& img_base_id : g_image_base_ids)
     {
         float opacity = 1.0f / ((!g_make_images_base_transparent) ? 1.0f : g_image_base_ids.size());
@@ -838,46 +2410,50 @@ void render_image_overlap()
         render_image(g_image_overlap, g_image_overlap_info, 1.0f, false, {});
 }
 
+bool is_marked_for_review(const ImageID& img_id)
+{
+    std::lock_guard lock(g_review_ids_mtx);
+
+    return g_review_ids.find(img_id) != g_review_ids.end();
+}
+
 void render_borders()
 {
     if (g_view_borders)
     {
-        for (int id_x = 0; id_x < (int)g_image_info.size(); ++id_x)
+        // Only adjusted images are in the index, which are the only ones with borders
+        for (size_t slot : g_image_index.query_rect(get_visible_index_rect()))
         {
-            for (int id_y = 0; id_y < (int)g_image_info[0].size(); ++id_y)
-            {
-                auto& info = get_img_info_from_id({ id_x, id_y });
-
-                if (info.has_been_adjusted)
-                {
-                    std::shared_lock lock(g_images_mtx);
-
-                    ns::Color color = COLOR_BLUE;
+            auto [id_x, id_y] = g_image_grid.get_id(slot);
+            auto info = g_image_grid.get_info(slot);
 
-                    // is ignored
-                    if (info.ignore)
-                    {
-                        color = COLOR_RED;
-                    }
-                    // is loaded
-                    else if (g_loaded_images.find(ImageID{ id_x, id_y }) != g_loaded_images.end())
-                    {
-                        // is in use
-                        if (g_image_base_ids.find(ImageID{ id_x, id_y }) != g_image_base_ids.end())
-                            color = COLOR_TURQUOISE;
-                        else
-                            color = COLOR_LIGHT_BLUE;
-                    }
+            if (info.has_been_adjusted)
+            {
+                std::shared_lock lock(g_images_mtx);
 
-                    auto img_ext = get_img_ext_from_id(g_image_current_id);
-                    if (!img_ext)
-                    {
-                        printf("Cannot render image %d/%d\n", g_image_current_id.x, g_image_current_id.y);
-                        continue;
-                    }
+                ns::Color color = COLOR_BLUE;
 
-                    render_image(*img_ext, info, 0.0f, true, color); // Transparent render, image content is irrelevant
+                // is ignored
+                if (info.ignore)
+                {
+                    color = COLOR_RED;
+                }
+                // needs review
+                else if (is_marked_for_review({ id_x, id_y }))
+                {
+                    color = COLOR_PURPLE;
                 }
+                // is loaded
+                else if (is_img_loaded({ id_x, id_y }))
+                {
+                    // is in use
+                    if (g_image_base_ids.find(ImageID{ id_x, id_y }) != g_image_base_ids.end())
+                        color = COLOR_TURQUOISE;
+                    else
+                        color = COLOR_LIGHT_BLUE;
+                }
+
+                render_border(info, color);
             }
         }
     }
@@ -887,16 +2463,9 @@ void render_image_mouse_select()
 {
     if (g_select_image_with_mouse)
     {
-        bool is_not_selectable = g_img_id_closest_to_mouse == ImageID{ 0, 0 };
-
-        auto img_ext = get_img_ext_from_id(g_image_current_id);
-        if (!img_ext)
-        {
-            printf("Cannot render image %d/%d\n", g_image_current_id.x, g_image_current_id.y);
-            return;
-        }
+        bool is_not_selectable = g_img_id_closest_to_mouse == get_reference_id();
 
-        render_image(*img_ext, g_image_info[g_img_id_closest_to_mouse.x][g_img_id_closest_to_mouse.y], 0.0f, true, is_not_selectable ? COLOR_RED : COLOR_ORANGE);
+        render_border(get_img_info_from_id(g_img_id_closest_to_mouse), is_not_selectable ? COLOR_RED : COLOR_ORANGE);
     }
 }
 
@@ -904,99 +2473,33 @@ void render_func()
 {
     update_images();
 
+    // Images are only collected here, the renderer draws them in batches
+    auto& renderer = get_image_renderer();
+    renderer.begin(g_camera);
+
+    render_thumbnails();
     render_images_base();
     render_image_current();
     render_image_overlap();
     render_borders();
     render_image_mouse_select();
-}
-
-bool move_to_best_diff_score(int test_range, int step_size)
-{
-    printf("Testing for best diff score in range %d...\n", test_range);
-
-    static std::vector<std::vector<float>> diff_scores(test_range * 2 + 1, std::vector<float>(test_range * 2 + 1, 0.0f));
-
-    DiffScoreThreadData diff_score_data;
-    diff_score_data.min_x = -test_range;
-    diff_score_data.min_y = -test_range;
-    diff_score_data.step_size = step_size;
-    diff_score_data.p_diff_scores = &diff_scores;
-
-    auto diff_score_func = [](const DiffScoreThreadData& data)
-    {
-        int id_x = data.off_x - data.min_x;
-        int id_y = data.off_y - data.min_y;
-        (*data.p_diff_scores)[id_x][id_y] = calculate_diff_rect(data.off_x, data.off_y, data.step_size, false);
-    };
-
-    for (int off_x = -test_range; off_x <= test_range; ++off_x)
-    {
-        for (int off_y = -test_range; off_y <= test_range; ++off_y)
-        {
-            diff_score_data.off_x = off_x;
-            diff_score_data.off_y = off_y;
-
-            g_thread_pool.push_job({ diff_score_func, diff_score_data });
-        }
-    }
-
-    while (!g_thread_pool.is_idle())
-        std::this_thread::sleep_for(std::chrono::milliseconds(5));
-
-    int best_off_x = 0, best_off_y = 0;
-    float best_diff_score = 1.1f;
-
-    for (int off_x = -test_range; off_x <= test_range; ++off_x)
-    {
-        for (int off_y = -test_range; off_y <= test_range; ++off_y)
-        {
-            int id_x = off_x + test_range;
-            int id_y = off_y + test_range;
-            float diff_score = diff_scores[id_x][id_y];
 
-            if (diff_score < best_diff_score)
-            {
-                best_diff_score = diff_score;
-                best_off_x = off_x;
-                best_off_y = off_y;
-            }
-        }
-    }
+    renderer.end();
 
-    get_img_info_from_id(g_image_current_id).pos_x += best_off_x;
-    get_img_info_from_id(g_image_current_id).pos_y += best_off_y;
-    
-    printf("  -> Diff score: %f -- off_x:%d off_y:%d\n", best_diff_score, best_off_x, best_off_y);
-
-    return best_off_x || best_off_y;
+    // Images whose upload did not fit into this frame's budget continue with the next frame
+    if (renderer.has_pending_uploads())
+        request_redraw();
 }
 
-bool move_to_local_minimum(int test_range, int max_iter, int step_size)
+// Returns whether any of the handled events requires a redraw
+bool handle_events(ns::Events& events)
 {
-    g_image_current_border_color = COLOR_GREY;
-
-    // Loops 'indefinitely', when max_iter <= 0
-    while (--max_iter != 0)
-        if (!move_to_best_diff_score(test_range, step_size))
-            break;
-
-    bool reached_local_minimum = max_iter != 0;
-
-    if (reached_local_minimum)
-        g_image_current_border_color = COLOR_GREEN;
-    else
-        g_image_current_border_color = COLOR_RED;
+    bool needs_redraw = false;
 
-    return reached_local_minimum;
-}
-
-void handle_events(ns::Events& events)
-{
-    std::optional<std::unique_ptr<const ns::Event>> opt_event;
+    std::optional<ns::Event> opt_event;
     while ((opt_event = events.try_pop()).has_value())
     {
-        auto pEvent = opt_event.value().get();
+        const ns::Event* pEvent = &opt_event.value();
 
         switch (pEvent->get_type())
         {
@@ -1009,30 +2512,11 @@ void handle_events(ns::Events& events)
                 int x = (event.get_pos_x() - 0.5f) / g_camera.zoom * 2.0f - g_camera.x;
                 int y = (event.get_pos_y() - 0.5f) / g_camera.zoom * 2.0f - g_camera.y;
 
-                int dist_closest = std::numeric_limits<int>::max();
-
-                for (int id_x = 0; id_x < (int)g_image_info.size(); ++id_x)
+                auto closest_key = g_image_index.query_nearest(x, y);
+                if (closest_key.has_value() && !(get_img_id_from_index_key(closest_key.value()) == g_img_id_closest_to_mouse))
                 {
-                    for (int id_y = 0; id_y < (int)g_image_info[0].size(); ++id_y)
-                    {
-                        auto& img_base_info = g_image_info[id_x][id_y];
-
-                        if (!img_base_info.has_been_adjusted)
-                            continue;
-
-                        Rect rect = get_rect_from_img_info(img_base_info);
-
-                        int dx = rect.x + rect.w / 2 - x;
-                        int dy = rect.y + rect.h / 2 - y;
-
-                        int dist = dx*dx + dy*dy;
-
-                        if (dist < dist_closest)
-                        {
-                            dist_closest = dist;
-                            g_img_id_closest_to_mouse = { id_x, id_y };
-                        }
-                    }
+                    g_img_id_closest_to_mouse = get_img_id_from_index_key(closest_key.value());
+                    needs_redraw = true;
                 }
             }
             break;
@@ -1040,6 +2524,7 @@ void handle_events(ns::Events& events)
         case ns::EventType::MouseButton:
         {
             auto& event = pEvent->as_type<ns::MouseButtonEvent>();
+            needs_redraw = true;
             
             static float down_x = 0.0f;
             static float down_y = 0.0f;
@@ -1048,7 +2533,7 @@ void handle_events(ns::Events& events)
             {
             case ns::MouseButtonEvent::State::Down:
             {
-                g_image_current_border_color = COLOR_GREY;
+                cancel_alignment();
 
                 if (event.get_button() == ns::MouseButtonEvent::Button::Middle)
                 {
@@ -1069,19 +2554,23 @@ void handle_events(ns::Events& events)
                 {
                     if (event.get_button() != ns::MouseButtonEvent::Button::Left && event.get_button() != ns::MouseButtonEvent::Button::Right)
                         break;
+                    if (!has_current_image())
+                        break;
     
                     float off_x = event.get_pos_x() - down_x;
                     float off_y = event.get_pos_y() - down_y;
     
-                    auto& img_info_curr = get_img_info_from_id(g_image_current_id);
-                    img_info_curr.pos_x += off_x / g_camera.zoom * 2.0f;
-                    img_info_curr.pos_y += off_y / g_camera.zoom * 2.0f;
-                    img_info_curr.has_been_adjusted = true;
+                    auto img_info_curr = get_img_info_from_id(g_image_current_id);
+                    move_image(g_image_current_id,
+                        (int)(img_info_curr.pos_x + off_x / g_camera.zoom * 2.0f),
+                        (int)(img_info_curr.pos_y + off_y / g_camera.zoom * 2.0f), true);
     
                     if (event.get_button() == ns::MouseButtonEvent::Button::Left)
+                        start_alignment(g_test_range, true);
+                    else
                     {
-                        if (move_to_local_minimum(g_test_range, MAX_ITER_TEST_LOCAL_MINIMUM, 2))
-                            move_to_local_minimum(g_test_range, MAX_ITER_TEST_LOCAL_MINIMUM, 1);
+                        invalidate_pair_offsets(g_image_current_id);
+                        start_speculation();
                     }
 
                     break;
@@ -1091,9 +2580,10 @@ void handle_events(ns::Events& events)
                     g_select_image_with_mouse = false;
 
                     // Skip default
-                    if (g_img_id_closest_to_mouse == ImageID{ 0, 0 })
+                    if (g_img_id_closest_to_mouse == get_reference_id())
                         break;
 
+                    cancel_alignment();
                     g_next_id = g_img_id_closest_to_mouse;
 
                     break;
@@ -1119,6 +2609,8 @@ void handle_events(ns::Events& events)
             {
             case ns::KeyboardEvent::State::Down:
             {
+                needs_redraw = true;
+
                     switch (event.get_key())
                 {
                 case 'w':
@@ -1141,82 +2633,92 @@ void handle_events(ns::Events& events)
                     break;
                 case 'i':
                 {
-                    auto& img_info = get_img_info_from_id(g_image_current_id);
-                    img_info.pos_y -= 1;
-                    img_info.has_been_adjusted = true;
+                    if (!has_current_image())
+                        break;
+
+                    cancel_alignment();
+                    auto img_info = get_img_info_from_id(g_image_current_id);
+                    move_image(g_image_current_id, img_info.pos_x, img_info.pos_y - 1, true);
+                    invalidate_pair_offsets(g_image_current_id);
+                    start_speculation();
                     break;
                 }
                 case 'k':
                 {
-                    auto& img_info = get_img_info_from_id(g_image_current_id);
-                    img_info.pos_y += 1;
-                    img_info.has_been_adjusted = true;
-                    g_image_current_border_color = COLOR_GREY;
+                    if (!has_current_image())
+                        break;
+
+                    cancel_alignment();
+                    auto img_info = get_img_info_from_id(g_image_current_id);
+                    move_image(g_image_current_id, img_info.pos_x, img_info.pos_y + 1, true);
+                    invalidate_pair_offsets(g_image_current_id);
+                    start_speculation();
                     break;
                 }
                 case 'j':
                 {
-                    auto& img_info = get_img_info_from_id(g_image_current_id);
-                    img_info.pos_x -= 1;
-                    img_info.has_been_adjusted = true;
-                    g_image_current_border_color = COLOR_GREY;
+                    if (!has_current_image())
+                        break;
+
+                    cancel_alignment();
+                    auto img_info = get_img_info_from_id(g_image_current_id);
+                    move_image(g_image_current_id, img_info.pos_x - 1, img_info.pos_y, true);
+                    invalidate_pair_offsets(g_image_current_id);
+                    start_speculation();
                     break;
                 }
                 case 'l':
                 {
-                    auto& img_info = get_img_info_from_id(g_image_current_id);
-                    img_info.pos_x += 1;
-                    img_info.has_been_adjusted = true;
-                    g_image_current_border_color = COLOR_GREY;
+                    if (!has_current_image())
+                        break;
+
+                    cancel_alignment();
+                    auto img_info = get_img_info_from_id(g_image_current_id);
+                    move_image(g_image_current_id, img_info.pos_x + 1, img_info.pos_y, true);
+                    invalidate_pair_offsets(g_image_current_id);
+                    start_speculation();
                     break;
                 }
                 case 'h':
                 {
-                    auto& img_info = get_img_info_from_id(g_image_current_id);
-                    img_info.ignore = !img_info.ignore;
-                    img_info.has_been_adjusted = true;
-                    printf("Set image ignore to %d\n", (int)img_info.ignore);
+                    if (!has_current_image())
+                        break;
+
+                    cancel_alignment();
+                    bool ignore = toggle_image_ignore(g_image_current_id);
+                    printf("Set image ignore to %d\n", (int)ignore);
+                    start_speculation();
                     break;
                 }
                 case 'n':
                 {
-                    auto& img_info = get_img_info_from_id(g_image_current_id);
+                    if (!has_current_image())
+                        break;
+
+                    auto img_info = get_img_info_from_id(g_image_current_id);
                     if (!img_info.has_been_adjusted)
                     {
                         printf("Adjust image before jumping to the next\n");
                         break;
                     }
 
-                    if (++g_next_id.x >= (int)g_image_info.size())
-                    {
-                        g_next_id.x = 0;
+                    cancel_alignment();
 
-                        if (++g_next_id.y >= (int)g_image_info[0].size())
-                        {
-                            // Last image reached, generate result and store on disk.
-                            g_next_id = { 1, 0 };
-                        }
+                    // Moving on counts as review
+                    {
+                        std::lock_guard lock(g_review_ids_mtx);
+                        g_review_ids.erase(g_image_current_id);
                     }
 
+                    g_next_id = get_following_id(g_next_id);
+
                     break;
                 }
                 case 'p':
                 {
-                    if (--g_next_id.x < 0)
-                    {
-                        g_next_id.x = (int)g_image_info.size() - 1;
-
-                        if (--g_next_id.y < 0)
-                        {
-                            g_next_id.y = (int)g_image_info[0].size() - 1;
-                        }
-                    }
+                    cancel_alignment();
 
-                    if (g_next_id.x == 0 && g_next_id.y == 0)
-                    {
-                        g_next_id.x = (int)g_image_info.size() - 1;
-                        g_next_id.y = (int)g_image_info[0].size() - 1;
-                    }
+                    g_next_id = get_preceding_id(g_next_id);
                     break;
                 }
                 case 'o':
@@ -1229,6 +2731,23 @@ void handle_events(ns::Events& events)
                     g_view_borders = !g_view_borders;
                     break;
                 }
+                case 'v':
+                {
+                    if (auto p_window = g_p_window.load())
+                    {
+                        auto stats = p_window->get_frame_stats();
+                        printf("Frame times over %lu frames: avg %.2f ms, max %.2f ms, last %.2f ms\n",
+                            stats.n_frames, stats.avg_ms, stats.max_ms, stats.last_ms);
+                        p_window->reset_frame_stats();
+                    }
+                    break;
+                }
+                case 'u':
+                {
+                    ns::Image::get_texture_pool().print_usage();
+                    ns::PixelBufferPool::get_default().print_usage();
+                    break;
+                }
                 case 't':
                 {
                     g_make_images_base_transparent = !g_make_images_base_transparent;
@@ -1236,7 +2755,20 @@ void handle_events(ns::Events& events)
                 }
                 case 'y':
                 {
-                    move_to_local_minimum(g_test_range, MAX_ITER_TEST_LOCAL_MINIMUM, 1);
+                    if (!has_current_image())
+                        break;
+
+                    start_alignment(g_test_range, false);
+                    break;
+                }
+                case 'g':
+                {
+                    if (!has_current_image())
+                        break;
+
+                    cancel_alignment();
+                    cancel_speculation();
+                    ns::push_task(g_thread_pool, optimize_positions);
                     break;
                 }
                 case 'f':
@@ -1298,23 +2830,18 @@ void handle_events(ns::Events& events)
                 }
                 case ']':
                 {
+                    if (!has_current_image())
+                        break;
+
                     g_max_image_use_distance = 0;
 
                     Rect rect_curr = get_rect_from_img_info(get_img_info_from_id(g_image_current_id));
 
-                    for (int id_x = 0; id_x < (int)g_image_info.size(); ++id_x)
+                    for (size_t key : g_image_index.query_rect({ rect_curr.x, rect_curr.y, rect_curr.w, rect_curr.h }))
                     {
-                        for (int id_y = 0; id_y < (int)g_image_info[0].size(); ++id_y)
-                        {
-                            Rect rect_overlap = get_overlap_rect(rect_curr, get_img_info_from_id({ id_x, id_y }));
-
-                            if (rect_overlap.w <= 0 || rect_overlap.h <= 0)
-                                continue;
-
-                            int dist = get_img_dist(g_image_current_id, { id_x, id_y });
-                            if (dist > g_max_image_use_distance)
-                                g_max_image_use_distance = dist;
-                        }
+                        int dist = get_img_dist(g_image_current_id, get_img_id_from_index_key(key));
+                        if (dist > g_max_image_use_distance)
+                            g_max_image_use_distance = dist;
                     }
 
                     g_max_image_use_distance /= 2;
@@ -1328,6 +2855,8 @@ void handle_events(ns::Events& events)
             }
             case ns::KeyboardEvent::State::Up:
             {
+                needs_redraw = true;
+
                 switch (event.get_key())
                 {
                 case ' ':
@@ -1353,51 +2882,80 @@ void handle_events(ns::Events& events)
         }
         }
     }
+
+    return needs_redraw;
 }
 
 void main_func(ns::Window* pWindow, ns::Events& events, std::function<bool (void)> is_alive)
 {
     pWindow->set_render_func(render_func);
+    pWindow->set_frame_cap(FRAME_CAP);
 
+    g_events = &events;
+    g_p_window = pWindow;
+
+    ns::push_task(g_thread_pool, build_thumbnail_atlas);
+
+    // Sleeps until there is input, finished background work or the window closes
     while (is_alive())
     {
-        handle_events(events);
+        events.wait();
 
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        run_user_tasks();
+        if (handle_events(events))
+            pWindow->invalidate();
     }
+
+    g_p_window = nullptr;
+    g_events = nullptr;
 }
 
 int main(int argc, char** argv)
 {
-    ns::init(&argc, argv);
+    bool auto_mode = argc == 3 && std::string(argv[1]) == "--auto";
 
-    if (!ns::is_initialized())
+    if (argc != 2 && !auto_mode)
+    {
+        printf("Usage: %s [--auto] <capture-dir-or-project-file>\n", argv[0]);
         exit(EXIT_FAILURE);
+    }
+
+    const char* path = argv[argc - 1];
 
-    if (argc != 2)
+    // Headless mode does not need a display
+    if (!auto_mode)
     {
-        printf("Usage: %s <capture-dir-or-project-file>\n", argv[0]);
-        exit(EXIT_FAILURE);
+        ns::init(&argc, argv);
+
+        if (!ns::is_initialized())
+            exit(EXIT_FAILURE);
     }
 
-    if (std::filesystem::is_regular_file(argv[1]))
+    if (std::filesystem::is_regular_file(path))
     {
-        load_project_from_file(argv[1]);
+        load_project_from_file(path);
     }
-    else if (std::filesystem::is_directory(argv[1]))
+    else if (std::filesystem::is_directory(path))
     {
-        g_capture_dir = argv[1];
+        g_capture_dir = path;
         if (!g_capture_dir.has_filename())
         g_capture_dir = g_capture_dir.parent_path();
         init_image_info();
+        g_next_id = get_following_id(get_reference_id());
     }
     else
     {
-        printf("Provided path '%s' is not a project file or directory path\n", argv[1]);
+        printf("Provided path '%s' is not a project file or directory path\n", path);
         exit(EXIT_FAILURE);
     }
 
+    if (auto_mode)
+    {
+        run_auto_stitching();
+        return 0;
+    }
+
     ns::Window window("NegativeScanner", 1000, 1000, 460, 20, main_func);
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,65 @@
+#include "Parallel.h"
+
+namespace ns
+{
+    void push_task(TaskPool& pool, const Task& task, bool high_priority)
+    {
+        TaskPool::Job job = { [](const Task& t){ t(); }, task };
+
+        if (high_priority)
+            pool.push_priority_job(job);
+        else
+            pool.push_job(job);
+    }
+
+    int64_t get_auto_grain(const TaskPool& pool, int64_t n_elements)
+    {
+        // Some more chunks than threads to even out chunks of different cost
+        int64_t n_chunks = std::max<int64_t>(1, pool.get_n_threads() * 4);
+        return std::max<int64_t>(1, (n_elements + n_chunks - 1) / n_chunks);
+    }
+
+    namespace detail
+    {
+        ParallelForState::ParallelForState(int64_t n_chunks, std::function<void (int64_t)> run_chunk)
+            : m_n_chunks(n_chunks), m_run_chunk(run_chunk),
+              m_next_chunk(0), m_n_chunks_done(0)
+        {}
+
+        void ParallelForState::work()
+        {
+            int64_t chunk;
+            while ((chunk = m_next_chunk++) < m_n_chunks)
+            {
+                std::exception_ptr exception;
+
+                try
+                {
+                    m_run_chunk(chunk);
+                }
+                catch (...)
+                {
+                    exception = std::current_exception();
+                }
+
+                std::unique_lock lock(m_mtx);
+
+                if (exception && !m_exception)
+                    m_exception = exception;
+
+                if (++m_n_chunks_done == m_n_chunks)
+                    m_con_var.notify_all();
+            }
+        }
+
+        void ParallelForState::wait()
+        {
+            std::unique_lock lock(m_mtx);
+
+            m_con_var.wait(lock, [&]{ return m_n_chunks_done == m_n_chunks; });
+
+            if (m_exception)
+                std::rethrow_exception(m_exception);
+        }
+    }
+}
@@ -0,0 +1,223 @@
+#include "PixelBufferPool.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <new>
+
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+namespace ns
+{
+    PixelBufferPool::PixelBufferPool(size_t budget)
+        : m_budget(budget),
+          m_use_huge_pages(true),
+          m_usage({ 0, 0, 0, 0, 0, 0, 0 })
+    {}
+
+    PixelBufferPool::~PixelBufferPool()
+    {
+        for (auto& [size_class, p] : m_free_order)
+            unmap(p, size_class);
+    }
+
+    void* PixelBufferPool::acquire(size_t size)
+    {
+        if (size < MIN_POOLED_SIZE)
+        {
+            void* p = std::malloc(std::max(size, (size_t)1));
+            if (!p)
+                throw std::bad_alloc();
+            return p;
+        }
+
+        size_t size_class = get_size_class(size);
+
+        {
+            std::lock_guard lock(m_mtx);
+
+            ++m_usage.n_in_use;
+            m_usage.bytes_in_use += size_class;
+
+            auto it = m_free.find(size_class);
+            if (it != m_free.end() && !it->second.empty())
+            {
+                void* p = it->second.back();
+                it->second.pop_back();
+
+                m_free_order.erase(std::find(m_free_order.begin(), m_free_order.end(), std::make_pair(size_class, p)));
+
+                --m_usage.n_free;
+                m_usage.bytes_free -= size_class;
+                ++m_usage.n_recycled;
+
+                return p;
+            }
+
+            ++m_usage.n_allocated;
+        }
+
+        // Mapping is done without the lock, it may take a while for large buffers
+        return map(size_class);
+    }
+
+    void PixelBufferPool::release(void* p, size_t size)
+    {
+        if (size < MIN_POOLED_SIZE)
+        {
+            std::free(p);
+            return;
+        }
+
+        size_t size_class = get_size_class(size);
+
+        std::lock_guard lock(m_mtx);
+
+        m_free[size_class].push_back(p);
+        m_free_order.push_back({ size_class, p });
+
+        --m_usage.n_in_use;
+        m_usage.bytes_in_use -= size_class;
+        ++m_usage.n_free;
+        m_usage.bytes_free += size_class;
+
+        trim();
+    }
+
+    void PixelBufferPool::set_budget(size_t budget)
+    {
+        std::lock_guard lock(m_mtx);
+
+        m_budget = budget;
+        trim();
+    }
+
+    size_t PixelBufferPool::get_budget() const
+    {
+        std::lock_guard lock(m_mtx);
+
+        return m_budget;
+    }
+
+    void PixelBufferPool::set_use_huge_pages(bool use_huge_pages)
+    {
+        std::lock_guard lock(m_mtx);
+
+        m_use_huge_pages = use_huge_pages;
+    }
+
+    PixelBufferPool::Usage PixelBufferPool::get_usage() const
+    {
+        std::lock_guard lock(m_mtx);
+
+        return m_usage;
+    }
+
+    void PixelBufferPool::print_usage() const
+    {
+        auto usage = get_usage();
+
+        printf("Pixel buffers: %lu in use (%lu MiB), %lu free (%lu MiB), budget %lu MiB\n",
+            usage.n_in_use, usage.bytes_in_use >> 20, usage.n_free, usage.bytes_free >> 20, get_budget() >> 20);
+        printf("  allocated: %lu, recycled: %lu, unmapped: %lu, page faults: %ld\n",
+            usage.n_allocated, usage.n_recycled, usage.n_unmapped, get_page_faults());
+    }
+
+    PixelBufferPool& PixelBufferPool::get_default()
+    {
+        // Created on first use, so images in static storage can be constructed in any order
+        static PixelBufferPool s_pool;
+        return s_pool;
+    }
+
+    long PixelBufferPool::get_page_faults()
+    {
+        rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) != 0)
+            return 0;
+
+        return usage.ru_minflt + usage.ru_majflt;
+    }
+
+    size_t PixelBufferPool::get_size_class(size_t size)
+    {
+        // Whole huge pages, captures of the same size always share a class
+        return (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    }
+
+    void* PixelBufferPool::map(size_t size_class)
+    {
+        bool use_huge_pages;
+        {
+            std::lock_guard lock(m_mtx);
+            use_huge_pages = m_use_huge_pages;
+        }
+
+        // Huge pages are only used for aligned regions, so one page more is mapped and the ends are cut off
+        size_t mapped_size = size_class + (use_huge_pages ? HUGE_PAGE_SIZE : 0);
+
+        void* p_mapped = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p_mapped == MAP_FAILED)
+        {
+            std::lock_guard lock(m_mtx);
+            --m_usage.n_in_use;
+            m_usage.bytes_in_use -= size_class;
+            throw std::bad_alloc();
+        }
+
+        if (!use_huge_pages)
+            return p_mapped;
+
+        auto begin = (uintptr_t)p_mapped;
+        auto aligned = (begin + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+
+        if (aligned > begin)
+            munmap(p_mapped, aligned - begin);
+        if (aligned + size_class < begin + mapped_size)
+            munmap((void*)(aligned + size_class), begin + mapped_size - aligned - size_class);
+
+#ifdef MADV_HUGEPAGE
+        madvise((void*)aligned, size_class, MADV_HUGEPAGE);
+#endif
+
+        return (void*)aligned;
+    }
+
+    void PixelBufferPool::unmap(void* p, size_t size_class)
+    {
+        munmap(p, size_class);
+    }
+
+    void PixelBufferPool::trim()
+    {
+        size_t n_trimmed = 0;
+
+        while (n_trimmed < m_free_order.size() && m_usage.bytes_free > m_budget)
+        {
+            auto [size_class, p] = m_free_order[n_trimmed++];
+
+            auto& free_list = m_free[size_class];
+            free_list.erase(std::find(free_list.begin(), free_list.end(), p));
+
+            unmap(p, size_class);
+
+            --m_usage.n_free;
+            m_usage.bytes_free -= size_class;
+            ++m_usage.n_unmapped;
+        }
+
+        m_free_order.erase(m_free_order.begin(), m_free_order.begin() + n_trimmed);
+    }
+
+    PixelBuffer::PixelBuffer(size_t size)
+        : m_data(static_cast<Color*>(PixelBufferPool::get_default().acquire(size * sizeof(Color)))),
+          m_size(size)
+    {}
+
+    PixelBuffer::~PixelBuffer()
+    {
+        PixelBufferPool::get_default().release(m_data, m_size * sizeof(Color));
+    }
+}
@@ -0,0 +1,228 @@
+#include "PositionSolver.h"
+
+#include <cmath>
+#include <numeric>
+#include <algorithm>
+
+namespace ns
+{
+    PositionSolver::PositionSolver(size_t n_nodes)
+        : m_n_nodes(n_nodes),
+          m_pos_x(n_nodes, 0.0), m_pos_y(n_nodes, 0.0),
+          m_is_fixed(n_nodes, false),
+          m_n_iterations(0)
+    {}
+
+    void PositionSolver::set_initial_pos(size_t node, double x, double y)
+    {
+        m_pos_x[node] = x;
+        m_pos_y[node] = y;
+    }
+
+    void PositionSolver::fix_node(size_t node)
+    {
+        m_is_fixed[node] = true;
+    }
+
+    void PositionSolver::add_constraint(size_t node_a, size_t node_b, double off_x, double off_y, double weight)
+    {
+        if (node_a == node_b || weight <= 0.0)
+            return;
+
+        m_constraints.push_back({ node_a, node_b, off_x, off_y, weight });
+    }
+
+    bool PositionSolver::solve(int max_iter, double tolerance)
+    {
+        fix_unanchored_components();
+
+        if (max_iter <= 0)
+            max_iter = std::max<int>(100, (int)m_n_nodes);
+
+        m_n_iterations = 0;
+
+        bool converged_x = solve_axis(m_pos_x, false, max_iter, tolerance);
+        bool converged_y = solve_axis(m_pos_y, true, max_iter, tolerance);
+
+        return converged_x && converged_y;
+    }
+
+    double PositionSolver::get_pos_x(size_t node) const
+    {
+        return m_pos_x[node];
+    }
+
+    double PositionSolver::get_pos_y(size_t node) const
+    {
+        return m_pos_y[node];
+    }
+
+    int PositionSolver::get_n_iterations() const
+    {
+        return m_n_iterations;
+    }
+
+    double PositionSolver::get_rms_residual() const
+    {
+        double sum = 0.0;
+        double sum_weights = 0.0;
+
+        for (auto& c : m_constraints)
+        {
+            double res_x = m_pos_x[c.node_b] - m_pos_x[c.node_a] - c.off_x;
+            double res_y = m_pos_y[c.node_b] - m_pos_y[c.node_a] - c.off_y;
+            sum += c.weight * (res_x * res_x + res_y * res_y);
+            sum_weights += c.weight;
+        }
+
+        return sum_weights > 0.0 ? std::sqrt(sum / sum_weights) : 0.0;
+    }
+
+    void PositionSolver::fix_unanchored_components()
+    {
+        // Union-find over the constraint graph
+        std::vector<size_t> parent(m_n_nodes);
+        std::iota(parent.begin(), parent.end(), 0);
+
+        auto find = [&](size_t node)
+        {
+            while (parent[node] != node)
+                node = parent[node] = parent[parent[node]];
+            return node;
+        };
+
+        for (auto& c : m_constraints)
+            parent[find(c.node_a)] = find(c.node_b);
+
+        std::vector<bool> is_anchored(m_n_nodes, false);
+        for (size_t node = 0; node < m_n_nodes; ++node)
+            if (m_is_fixed[node])
+                is_anchored[find(node)] = true;
+
+        for (size_t node = 0; node < m_n_nodes; ++node)
+        {
+            size_t root = find(node);
+            if (is_anchored[root])
+                continue;
+
+            m_is_fixed[node] = true;
+            is_anchored[root] = true;
+        }
+    }
+
+    bool PositionSolver::solve_axis(std::vector<double>& pos, bool axis_y, int max_iter, double tolerance)
+    {
+        // Right hand side of the normal equations, with the fixed nodes moved over
+        std::vector<double> rhs(m_n_nodes, 0.0);
+        std::vector<double> diag(m_n_nodes, 0.0);
+
+        for (auto& c : m_constraints)
+        {
+            double off = axis_y ? c.off_y : c.off_x;
+
+            rhs[c.node_b] += c.weight * off;
+            rhs[c.node_a] -= c.weight * off;
+            diag[c.node_a] += c.weight;
+            diag[c.node_b] += c.weight;
+
+            if (m_is_fixed[c.node_a])
+                rhs[c.node_b] += c.weight * pos[c.node_a];
+            if (m_is_fixed[c.node_b])
+                rhs[c.node_a] += c.weight * pos[c.node_b];
+        }
+
+        // Residual r = rhs - A * pos over the free nodes, fixed entries stay zero
+        std::vector<double> r(m_n_nodes, 0.0);
+        std::vector<double> z(m_n_nodes, 0.0);
+        std::vector<double> p(m_n_nodes, 0.0);
+        std::vector<double> ap(m_n_nodes, 0.0);
+
+        multiply(pos, ap);
+
+        double rhs_norm = 0.0;
+        for (size_t i = 0; i < m_n_nodes; ++i)
+        {
+            if (m_is_fixed[i] || diag[i] <= 0.0)
+                continue;
+
+            r[i] = rhs[i] - ap[i];
+            rhs_norm += rhs[i] * rhs[i];
+        }
+
+        rhs_norm = std::sqrt(rhs_norm);
+        if (rhs_norm == 0.0)
+            rhs_norm = 1.0;
+
+        auto precondition = [&]()
+        {
+            for (size_t i = 0; i < m_n_nodes; ++i)
+                z[i] = diag[i] > 0.0 ? r[i] / diag[i] : 0.0;
+        };
+
+        precondition();
+        p = z;
+
+        double rz = 0.0;
+        for (size_t i = 0; i < m_n_nodes; ++i)
+            rz += r[i] * z[i];
+
+        for (int iter = 0; iter < max_iter; ++iter)
+        {
+            double r_norm = 0.0;
+            for (size_t i = 0; i < m_n_nodes; ++i)
+                r_norm += r[i] * r[i];
+
+            if (std::sqrt(r_norm) <= tolerance * rhs_norm)
+                return true;
+
+            ++m_n_iterations;
+
+            multiply(p, ap);
+
+            double pap = 0.0;
+            for (size_t i = 0; i < m_n_nodes; ++i)
+                pap += p[i] * ap[i];
+
+            if (pap <= 0.0)
+                return true;
+
+            double alpha = rz / pap;
+            for (size_t i = 0; i < m_n_nodes; ++i)
+            {
+                pos[i] += alpha * p[i];
+                r[i] -= alpha * ap[i];
+            }
+
+            precondition();
+
+            double rz_new = 0.0;
+            for (size_t i = 0; i < m_n_nodes; ++i)
+                rz_new += r[i] * z[i];
+
+            double beta = rz_new / rz;
+            rz = rz_new;
+
+            for (size_t i = 0; i < m_n_nodes; ++i)
+                p[i] = z[i] + beta * p[i];
+        }
+
+        return false;
+    }
+
+    void PositionSolver::multiply(const std::vector<double>& x, std::vector<double>& y) const
+    {
+        // y = L * x restricted to the free nodes (fixed nodes act as zero)
+        std::fill(y.begin(), y.end(), 0.0);
+
+        for (auto& c : m_constraints)
+        {
+            double x_a = m_is_fixed[c.node_a] ? 0.0 : x[c.node_a];
+            double x_b = m_is_fixed[c.node_b] ? 0.0 : x[c.node_b];
+
+            if (!m_is_fixed[c.node_a])
+                y[c.node_a] += c.weight * (x_a - x_b);
+            if (!m_is_fixed[c.node_b])
+                y[c.node_b] += c.weight * (x_b - x_a);
+        }
+    }
+}
@@ -0,0 +1,50 @@
+#include "PpmWriter.h"
+
+namespace ns
+{
+    PpmWriter::PpmWriter()
+        : m_width(0), m_height(0), m_bytes_per_sample(1), m_n_rows_written(0)
+    {}
+
+    bool PpmWriter::open(const std::string& filepath, int width, int height, int bit_depth)
+    {
+        m_file.open(filepath, std::ios::binary | std::ios::trunc);
+
+        if (!m_file.good())
+            return false;
+
+        m_width = width;
+        m_height = height;
+        m_bytes_per_sample = bit_depth > 8 ? 2 : 1;
+        m_n_rows_written = 0;
+
+        m_file << "P6\n" << width << " " << height << "\n" << (bit_depth > 8 ? 65535 : 255) << "\n";
+
+        return m_file.good();
+    }
+
+    bool PpmWriter::write_row(const uint8_t* rgb)
+    {
+        if (m_n_rows_written >= m_height)
+            return false;
+
+        m_file.write(reinterpret_cast<const char*>(rgb), (std::streamsize)m_width * 3 * m_bytes_per_sample);
+        ++m_n_rows_written;
+
+        return m_file.good();
+    }
+
+    bool PpmWriter::close()
+    {
+        bool is_complete = m_n_rows_written == m_height;
+
+        m_file.close();
+
+        return is_complete && !m_file.fail();
+    }
+
+    int PpmWriter::get_n_rows_written() const
+    {
+        return m_n_rows_written;
+    }
+}
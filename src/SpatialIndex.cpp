@@ -0,0 +1,256 @@
+#include "SpatialIndex.h"
+
+#include <limits>
+#include <algorithm>
+
+namespace ns
+{
+    SpatialIndex::SpatialIndex(int cell_size)
+        : m_cell_size(std::max(1, cell_size)),
+          m_min_cell_x(0), m_min_cell_y(0),
+          m_max_cell_x(-1), m_max_cell_y(-1)
+    {}
+
+    void SpatialIndex::update(size_t key, const Rect& rect)
+    {
+        std::lock_guard lock(m_mtx);
+
+        auto it = m_rects.find(key);
+        if (it != m_rects.end())
+        {
+            if (it->second.x == rect.x && it->second.y == rect.y &&
+                it->second.w == rect.w && it->second.h == rect.h)
+                return;
+
+            remove_cells(key, it->second);
+            it->second = rect;
+        }
+        else
+        {
+            m_rects.insert({ key, rect });
+        }
+
+        insert_cells(key, rect);
+    }
+
+    void SpatialIndex::remove(size_t key)
+    {
+        std::lock_guard lock(m_mtx);
+
+        auto it = m_rects.find(key);
+        if (it == m_rects.end())
+            return;
+
+        remove_cells(key, it->second);
+        m_rects.erase(it);
+    }
+
+    void SpatialIndex::clear()
+    {
+        std::lock_guard lock(m_mtx);
+
+        m_rects.clear();
+        m_cells.clear();
+        m_min_cell_x = m_min_cell_y = 0;
+        m_max_cell_x = m_max_cell_y = -1;
+    }
+
+    void SpatialIndex::set_cell_size(int cell_size)
+    {
+        std::lock_guard lock(m_mtx);
+
+        cell_size = std::max(1, cell_size);
+        if (cell_size == m_cell_size)
+            return;
+
+        m_cell_size = cell_size;
+        m_cells.clear();
+        m_min_cell_x = m_min_cell_y = 0;
+        m_max_cell_x = m_max_cell_y = -1;
+
+        for (auto& [key, rect] : m_rects)
+            insert_cells(key, rect);
+    }
+
+    size_t SpatialIndex::size() const
+    {
+        std::lock_guard lock(m_mtx);
+
+        return m_rects.size();
+    }
+
+    bool SpatialIndex::contains(size_t key) const
+    {
+        std::lock_guard lock(m_mtx);
+
+        return m_rects.find(key) != m_rects.end();
+    }
+
+    std::vector<size_t> SpatialIndex::query_rect(const Rect& rect) const
+    {
+        std::lock_guard lock(m_mtx);
+
+        std::vector<size_t> keys;
+
+        if (rect.w <= 0 || rect.h <= 0)
+            return keys;
+
+        int cell_x_begin = std::max(get_cell_coord(rect.x), m_min_cell_x);
+        int cell_y_begin = std::max(get_cell_coord(rect.y), m_min_cell_y);
+        int cell_x_end = std::min(get_cell_coord(rect.x + rect.w - 1), m_max_cell_x);
+        int cell_y_end = std::min(get_cell_coord(rect.y + rect.h - 1), m_max_cell_y);
+
+        for (int cell_x = cell_x_begin; cell_x <= cell_x_end; ++cell_x)
+        {
+            for (int cell_y = cell_y_begin; cell_y <= cell_y_end; ++cell_y)
+            {
+                auto it = m_cells.find(get_cell_key(cell_x, cell_y));
+                if (it == m_cells.end())
+                    continue;
+
+                for (size_t key : it->second)
+                {
+                    auto& other = m_rects.at(key);
+
+                    if (other.x >= rect.x + rect.w || rect.x >= other.x + std::max(other.w, 1) ||
+                        other.y >= rect.y + rect.h || rect.y >= other.y + std::max(other.h, 1))
+                        continue;
+
+                    keys.push_back(key);
+                }
+            }
+        }
+
+        // Rectangles covering multiple visited cells are found multiple times
+        std::sort(keys.begin(), keys.end());
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+        return keys;
+    }
+
+    std::optional<size_t> SpatialIndex::query_nearest(int x, int y, std::function<bool (size_t)> filter) const
+    {
+        std::lock_guard lock(m_mtx);
+
+        if (m_rects.empty())
+            return {};
+
+        int center_cell_x = get_cell_coord(x);
+        int center_cell_y = get_cell_coord(y);
+
+        // Rings beyond this radius cannot contain any rectangle
+        int max_radius = std::max({
+            std::abs(center_cell_x - m_min_cell_x), std::abs(center_cell_x - m_max_cell_x),
+            std::abs(center_cell_y - m_min_cell_y), std::abs(center_cell_y - m_max_cell_y)
+        });
+
+        std::optional<size_t> best_key;
+        int64_t best_dist = std::numeric_limits<int64_t>::max();
+
+        auto visit_cell = [&](int cell_x, int cell_y)
+        {
+            auto it = m_cells.find(get_cell_key(cell_x, cell_y));
+            if (it == m_cells.end())
+                return;
+
+            for (size_t key : it->second)
+            {
+                auto& rect = m_rects.at(key);
+
+                int64_t dx = rect.x + rect.w / 2 - x;
+                int64_t dy = rect.y + rect.h / 2 - y;
+                int64_t dist = dx*dx + dy*dy;
+
+                if (dist >= best_dist || (filter && !filter(key)))
+                    continue;
+
+                best_dist = dist;
+                best_key = key;
+            }
+        };
+
+        for (int radius = 0; radius <= max_radius; ++radius)
+        {
+            // Centers in cells of this ring are at least (radius - 1) cells away
+            if (best_key.has_value())
+            {
+                int64_t min_dist = (int64_t)std::max(0, radius - 1) * m_cell_size;
+                if (min_dist * min_dist > best_dist)
+                    break;
+            }
+
+            for (int cell_x = center_cell_x - radius; cell_x <= center_cell_x + radius; ++cell_x)
+            {
+                bool is_edge_column = cell_x == center_cell_x - radius || cell_x == center_cell_x + radius;
+                int step = is_edge_column ? 1 : std::max(1, radius * 2);
+
+                for (int cell_y = center_cell_y - radius; cell_y <= center_cell_y + radius; cell_y += step)
+                    visit_cell(cell_x, cell_y);
+            }
+        }
+
+        return best_key;
+    }
+
+    void SpatialIndex::insert_cells(size_t key, const Rect& rect)
+    {
+        int cell_x_begin = get_cell_coord(rect.x);
+        int cell_y_begin = get_cell_coord(rect.y);
+        int cell_x_end = get_cell_coord(rect.x + std::max(rect.w, 1) - 1);
+        int cell_y_end = get_cell_coord(rect.y + std::max(rect.h, 1) - 1);
+
+        for (int cell_x = cell_x_begin; cell_x <= cell_x_end; ++cell_x)
+            for (int cell_y = cell_y_begin; cell_y <= cell_y_end; ++cell_y)
+                m_cells[get_cell_key(cell_x, cell_y)].push_back(key);
+
+        if (m_max_cell_x < m_min_cell_x)
+        {
+            m_min_cell_x = cell_x_begin;
+            m_min_cell_y = cell_y_begin;
+            m_max_cell_x = cell_x_end;
+            m_max_cell_y = cell_y_end;
+        }
+        else
+        {
+            m_min_cell_x = std::min(m_min_cell_x, cell_x_begin);
+            m_min_cell_y = std::min(m_min_cell_y, cell_y_begin);
+            m_max_cell_x = std::max(m_max_cell_x, cell_x_end);
+            m_max_cell_y = std::max(m_max_cell_y, cell_y_end);
+        }
+    }
+
+    void SpatialIndex::remove_cells(size_t key, const Rect& rect)
+    {
+        int cell_x_begin = get_cell_coord(rect.x);
+        int cell_y_begin = get_cell_coord(rect.y);
+        int cell_x_end = get_cell_coord(rect.x + std::max(rect.w, 1) - 1);
+        int cell_y_end = get_cell_coord(rect.y + std::max(rect.h, 1) - 1);
+
+        for (int cell_x = cell_x_begin; cell_x <= cell_x_end; ++cell_x)
+        {
+            for (int cell_y = cell_y_begin; cell_y <= cell_y_end; ++cell_y)
+            {
+                auto it = m_cells.find(get_cell_key(cell_x, cell_y));
+                if (it == m_cells.end())
+                    continue;
+
+                auto& keys = it->second;
+                keys.erase(std::remove(keys.begin(), keys.end(), key), keys.end());
+
+                if (keys.empty())
+                    m_cells.erase(it);
+            }
+        }
+    }
+
+    int SpatialIndex::get_cell_coord(int v) const
+    {
+        // Floor division, positions may be negative
+        return v >= 0 ? v / m_cell_size : -((-v + m_cell_size - 1) / m_cell_size);
+    }
+
+    uint64_t SpatialIndex::get_cell_key(int cell_x, int cell_y)
+    {
+        return ((uint64_t)(uint32_t)cell_x << 32) | (uint32_t)cell_y;
+    }
+}
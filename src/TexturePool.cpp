@@ -0,0 +1,149 @@
+#include "TexturePool.h"
+
+#include <algorithm>
+#include <cstdio>
+
+namespace ns
+{
+    size_t PooledTexture::get_size() const
+    {
+        size_t texel_size = 4;
+        switch (internal_format)
+        {
+        case GL_RGB16F:  texel_size = 8;  break; // Usually padded to four channels
+        case GL_RGBA32F: texel_size = 16; break;
+        default: break;
+        }
+
+        return (size_t)width * height * texel_size;
+    }
+
+    TexturePool::TexturePool(size_t budget)
+        : m_budget(budget),
+          m_usage({ 0, 0, 0, 0, 0, 0, 0 }),
+          m_has_warned_budget(false)
+    {}
+
+    PooledTexture TexturePool::acquire(int width, int height, GLenum internal_format, GLenum format, GLenum type)
+    {
+        std::lock_guard lock(m_mtx);
+
+        PooledTexture texture = { 0, width, height, internal_format };
+
+        auto it = m_free.find({ width, height, internal_format });
+        if (it != m_free.end() && !it->second.empty())
+        {
+            texture = it->second.back();
+            it->second.pop_back();
+
+            m_free_order.erase(std::find_if(m_free_order.begin(), m_free_order.end(), [&](const PooledTexture& t) { return t.id == texture.id; }));
+
+            --m_usage.n_free;
+            m_usage.bytes_free -= texture.get_size();
+            ++m_usage.n_recycled;
+        }
+        else
+        {
+            glGenTextures(1, &texture.id);
+            glBindTexture(GL_TEXTURE_2D, texture.id);
+
+            glTexImage2D(GL_TEXTURE_2D, 0, internal_format, width, height, 0, format, type, nullptr);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+            ++m_usage.n_allocated;
+        }
+
+        ++m_usage.n_in_use;
+        m_usage.bytes_in_use += texture.get_size();
+
+        if (m_usage.bytes_in_use > m_budget && !m_has_warned_budget)
+        {
+            printf("Textures in use exceed the GPU memory budget of %lu MiB\n", m_budget >> 20);
+            m_has_warned_budget = true;
+        }
+
+        trim();
+
+        return texture;
+    }
+
+    void TexturePool::release(const PooledTexture& texture)
+    {
+        std::lock_guard lock(m_mtx);
+
+        m_released.push_back(texture);
+    }
+
+    void TexturePool::collect()
+    {
+        std::lock_guard lock(m_mtx);
+
+        for (auto& texture : m_released)
+        {
+            m_free[{ texture.width, texture.height, texture.internal_format }].push_back(texture);
+            m_free_order.push_back(texture);
+
+            --m_usage.n_in_use;
+            m_usage.bytes_in_use -= texture.get_size();
+            ++m_usage.n_free;
+            m_usage.bytes_free += texture.get_size();
+        }
+
+        m_released.clear();
+
+        trim();
+    }
+
+    void TexturePool::set_budget(size_t budget)
+    {
+        std::lock_guard lock(m_mtx);
+
+        m_budget = budget;
+        m_has_warned_budget = false;
+    }
+
+    size_t TexturePool::get_budget() const
+    {
+        std::lock_guard lock(m_mtx);
+
+        return m_budget;
+    }
+
+    TexturePool::Usage TexturePool::get_usage() const
+    {
+        std::lock_guard lock(m_mtx);
+
+        return m_usage;
+    }
+
+    void TexturePool::print_usage() const
+    {
+        auto usage = get_usage();
+
+        printf("Textures: %lu in use (%lu MiB), %lu free (%lu MiB), budget %lu MiB\n",
+            usage.n_in_use, usage.bytes_in_use >> 20, usage.n_free, usage.bytes_free >> 20, get_budget() >> 20);
+        printf("  allocated: %lu, recycled: %lu, deleted: %lu\n", usage.n_allocated, usage.n_recycled, usage.n_deleted);
+    }
+
+    void TexturePool::trim()
+    {
+        size_t n_trimmed = 0;
+
+        while (n_trimmed < m_free_order.size() && m_usage.bytes_in_use + m_usage.bytes_free > m_budget)
+        {
+            auto& texture = m_free_order[n_trimmed++];
+
+            auto& free_list = m_free[{ texture.width, texture.height, texture.internal_format }];
+            free_list.erase(std::find_if(free_list.begin(), free_list.end(), [&](const PooledTexture& t) { return t.id == texture.id; }));
+
+            glDeleteTextures(1, &texture.id);
+
+            --m_usage.n_free;
+            m_usage.bytes_free -= texture.get_size();
+            ++m_usage.n_deleted;
+        }
+
+        m_free_order.erase(m_free_order.begin(), m_free_order.begin() + n_trimmed);
+    }
+}
@@ -0,0 +1,80 @@
+#include "TextureUploader.h"
+
+#include <algorithm>
+#include <cstdio>
+
+namespace ns
+{
+    TextureUploader::TextureUploader(size_t frame_budget, int n_buffers)
+        : m_frame_budget(frame_budget), m_bytes_uploaded(0),
+          m_has_deferred(false),
+          m_buffers(std::max(1, n_buffers), 0), m_next_buffer(0)
+    {
+        glGenBuffers((GLsizei)m_buffers.size(), m_buffers.data());
+    }
+
+    TextureUploader::~TextureUploader()
+    {
+        glDeleteBuffers((GLsizei)m_buffers.size(), m_buffers.data());
+    }
+
+    void TextureUploader::begin_frame()
+    {
+        m_bytes_uploaded = 0;
+        m_has_deferred = false;
+    }
+
+    size_t TextureUploader::get_budget_left() const
+    {
+        return m_bytes_uploaded < m_frame_budget ? m_frame_budget - m_bytes_uploaded : 0;
+    }
+
+    bool TextureUploader::is_budget_untouched() const
+    {
+        return m_bytes_uploaded == 0;
+    }
+
+    void TextureUploader::defer()
+    {
+        m_has_deferred = true;
+    }
+
+    bool TextureUploader::has_deferred() const
+    {
+        return m_has_deferred;
+    }
+
+    size_t TextureUploader::get_bytes_uploaded() const
+    {
+        return m_bytes_uploaded;
+    }
+
+    void TextureUploader::upload(GLuint texture, int x, int y, int width, int height, GLenum format, GLenum type, size_t size, const std::function<void (void*)>& fill)
+    {
+        // Buffers are used round-robin, one still read by the driver is not waited for
+        GLuint buffer = m_buffers[m_next_buffer];
+        m_next_buffer = (m_next_buffer + 1) % m_buffers.size();
+
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW);
+
+        void* p = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+        if (p)
+        {
+            fill(p);
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+            glBindTexture(GL_TEXTURE_2D, texture);
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, width, height, format, type, nullptr);
+        }
+        else
+        {
+            fprintf(stderr, "Unable to map pixel buffer of %lu bytes\n", size);
+        }
+
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+        m_bytes_uploaded += size;
+    }
+}
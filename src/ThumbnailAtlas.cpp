@@ -0,0 +1,217 @@
+#include "ThumbnailAtlas.h"
+
+#include <fstream>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+namespace ns
+{
+    ThumbnailAtlas::ThumbnailAtlas(int size_x, int size_y, int capture_width, int capture_height)
+        : m_size_x(std::max(size_x, 1)), m_size_y(std::max(size_y, 1)),
+          m_capture_width(std::max(capture_width, 1)), m_capture_height(std::max(capture_height, 1)),
+          m_n_thumbnails(0)
+    {
+        // Cells keep the aspect ratio of the captures, the atlas has to fit into one texture
+        float scale = (float)THUMBNAIL_SIZE / std::max(m_capture_width, m_capture_height);
+        scale = std::min(scale, (float)MAX_ATLAS_SIZE / (m_size_x * m_capture_width));
+        scale = std::min(scale, (float)MAX_ATLAS_SIZE / (m_size_y * m_capture_height));
+
+        m_cell_width = std::max(1, (int)(m_capture_width * scale));
+        m_cell_height = std::max(1, (int)(m_capture_height * scale));
+
+        m_img = Image(m_size_x * m_cell_width, m_size_y * m_cell_height);
+        m_has_thumbnail.resize((size_t)m_size_x * m_size_y, false);
+    }
+
+    void ThumbnailAtlas::set_thumbnail(int id_x, int id_y, const Image& capture)
+    {
+        if (id_x < 0 || id_y < 0 || id_x >= m_size_x || id_y >= m_size_y)
+            return;
+
+        float step_x = (float)capture.get_width() / m_cell_width;
+        float step_y = (float)capture.get_height() / m_cell_height;
+
+        for (int y = 0; y < m_cell_height; ++y)
+        {
+            int sy0 = (int)(y * step_y);
+            int sy1 = std::max(sy0 + 1, std::min((int)((y + 1) * step_y), capture.get_height()));
+
+            for (int x = 0; x < m_cell_width; ++x)
+            {
+                int sx0 = (int)(x * step_x);
+                int sx1 = std::max(sx0 + 1, std::min((int)((x + 1) * step_x), capture.get_width()));
+
+                // Box filter over the capture pixels covered by the thumbnail pixel
+                Color c = { 0.0f, 0.0f, 0.0f, 0.0f };
+                for (int sy = sy0; sy < sy1; ++sy)
+                {
+                    const Color* row = capture.get_row(sy);
+                    for (int sx = sx0; sx < sx1; ++sx)
+                    {
+                        c.r += row[sx].r;
+                        c.g += row[sx].g;
+                        c.b += row[sx].b;
+                    }
+                }
+
+                float n = (float)((sx1 - sx0) * (sy1 - sy0));
+
+                // put_pixel marks the pixel dirty after writing it, so a concurrent upload cannot miss it
+                m_img.put_pixel({ c.r / n, c.g / n, c.b / n, 1.0f }, id_x * m_cell_width + x, id_y * m_cell_height + y);
+            }
+        }
+
+        std::lock_guard lock(m_mtx);
+
+        size_t index = (size_t)id_y * m_size_x + id_x;
+        if (!m_has_thumbnail[index])
+        {
+            m_has_thumbnail[index] = true;
+            ++m_n_thumbnails;
+        }
+    }
+
+    bool ThumbnailAtlas::has_thumbnail(int id_x, int id_y) const
+    {
+        if (id_x < 0 || id_y < 0 || id_x >= m_size_x || id_y >= m_size_y)
+            return false;
+
+        std::lock_guard lock(m_mtx);
+
+        return m_has_thumbnail[(size_t)id_y * m_size_x + id_x];
+    }
+
+    int ThumbnailAtlas::get_n_thumbnails() const
+    {
+        std::lock_guard lock(m_mtx);
+
+        return m_n_thumbnails;
+    }
+
+    const Image& ThumbnailAtlas::get_image() const
+    {
+        return m_img;
+    }
+
+    void ThumbnailAtlas::get_cell_uv(int id_x, int id_y, float uv[4]) const
+    {
+        uv[0] = (float)id_x / m_size_x;
+        uv[1] = (float)id_y / m_size_y;
+        uv[2] = 1.0f / m_size_x;
+        uv[3] = 1.0f / m_size_y;
+    }
+
+    int ThumbnailAtlas::get_level() const
+    {
+        return std::max(0, (int)std::floor(std::log2((float)m_capture_width / m_cell_width)));
+    }
+
+    int ThumbnailAtlas::get_size_x() const
+    {
+        return m_size_x;
+    }
+
+    int ThumbnailAtlas::get_size_y() const
+    {
+        return m_size_y;
+    }
+
+    int ThumbnailAtlas::get_capture_width() const
+    {
+        return m_capture_width;
+    }
+
+    int ThumbnailAtlas::get_capture_height() const
+    {
+        return m_capture_height;
+    }
+
+    bool ThumbnailAtlas::save_to_file(const std::string& filepath) const
+    {
+        std::ofstream file(filepath, std::ios::binary);
+
+        if (!file.good())
+            return false;
+
+        FileHeader header = {
+            { 'N', 'S', 'T', 'A' },
+            FILE_VERSION,
+            m_size_x, m_size_y,
+            m_capture_width, m_capture_height,
+            m_cell_width, m_cell_height
+        };
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+        {
+            std::lock_guard lock(m_mtx);
+
+            for (bool has_thumbnail : m_has_thumbnail)
+                file.put(has_thumbnail ? 1 : 0);
+        }
+
+        // Thumbnails are display only, 8 bits per channel are enough
+        std::vector<unsigned char> row_data(m_img.get_width() * 3);
+        for (int y = 0; y < m_img.get_height(); ++y)
+        {
+            const Color* row = m_img.get_row(y);
+            for (int x = 0; x < m_img.get_width(); ++x)
+            {
+                row_data[x * 3 + 0] = (unsigned char)(std::clamp(row[x].r, 0.0f, 1.0f) * 255.0f + 0.5f);
+                row_data[x * 3 + 1] = (unsigned char)(std::clamp(row[x].g, 0.0f, 1.0f) * 255.0f + 0.5f);
+                row_data[x * 3 + 2] = (unsigned char)(std::clamp(row[x].b, 0.0f, 1.0f) * 255.0f + 0.5f);
+            }
+            file.write(reinterpret_cast<const char*>(row_data.data()), row_data.size());
+        }
+
+        return file.good();
+    }
+
+    bool ThumbnailAtlas::load_from_file(const std::string& filepath)
+    {
+        std::ifstream file(filepath, std::ios::binary);
+
+        if (!file.good())
+            return false;
+
+        FileHeader header;
+        file.read(reinterpret_cast<char*>(&header), sizeof(header));
+
+        if (!file.good() || std::memcmp(header.magic, "NSTA", sizeof(header.magic)) != 0 ||
+            header.version != FILE_VERSION ||
+            header.size_x != m_size_x || header.size_y != m_size_y ||
+            header.capture_width != m_capture_width || header.capture_height != m_capture_height ||
+            header.cell_width != m_cell_width || header.cell_height != m_cell_height)
+        {
+            return false;
+        }
+
+        std::vector<bool> has_thumbnail(m_has_thumbnail.size());
+        int n_thumbnails = 0;
+        for (size_t i = 0; i < has_thumbnail.size(); ++i)
+        {
+            has_thumbnail[i] = file.get() != 0;
+            n_thumbnails += has_thumbnail[i] ? 1 : 0;
+        }
+
+        std::vector<unsigned char> row_data(m_img.get_width() * 3);
+        for (int y = 0; y < m_img.get_height(); ++y)
+        {
+            file.read(reinterpret_cast<char*>(row_data.data()), row_data.size());
+            if (!file.good())
+                return false;
+
+            Color* row = m_img.get_mutable_row(y);
+            for (int x = 0; x < m_img.get_width(); ++x)
+                row[x] = { row_data[x * 3 + 0] / 255.0f, row_data[x * 3 + 1] / 255.0f, row_data[x * 3 + 2] / 255.0f, 1.0f };
+        }
+
+        std::lock_guard lock(m_mtx);
+
+        m_has_thumbnail = std::move(has_thumbnail);
+        m_n_thumbnails = n_thumbnails;
+
+        return true;
+    }
+}
@@ -3,6 +3,8 @@
 #include <stdexcept>
 #include <cstring>
 #include <cassert>
+#include <chrono>
+#include <algorithm>
 
 #include "glIncludes.h"
 
@@ -19,8 +21,10 @@ namespace ns
 
     Window::Window(const std::string& title, int width, int height, int x, int y, std::function<void (Window*, Events&, std::function<bool (void)>)> user_func)
         : m_width(width), m_height(height),
-          m_is_alive(true), m_user_thread(),
-          m_events()
+          m_is_alive(true), m_is_dirty(true), m_frame_cap(60),
+          m_user_thread(),
+          m_events(),
+          m_frame_stats({ 0, 0.0f, 0.0f, 0.0f })
     {
         g_window = this;
 
@@ -43,7 +47,7 @@ namespace ns
         };
 
         glutDisplayFunc(display_callback);
-        glutIdleFunc(display_callback);
+        glutTimerFunc(0, timer_callback, 0);
 
         glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
 
@@ -71,6 +75,7 @@ namespace ns
     Window::~Window()
     {
         m_is_alive = false;
+        m_events.wake();
         m_user_thread.join();
 
         g_window = nullptr;
@@ -81,8 +86,32 @@ namespace ns
         m_render_func = render_func;
     }
 
+    void Window::invalidate()
+    {
+        m_is_dirty = true;
+    }
+
+    void Window::set_frame_cap(int max_fps)
+    {
+        m_frame_cap = std::max(0, max_fps);
+    }
+
+    FrameStats Window::get_frame_stats() const
+    {
+        std::lock_guard lock(m_frame_stats_mtx);
+        return m_frame_stats;
+    }
+
+    void Window::reset_frame_stats()
+    {
+        std::lock_guard lock(m_frame_stats_mtx);
+        m_frame_stats = { 0, 0.0f, 0.0f, 0.0f };
+    }
+
     void Window::cb_render_scene()
     {
+        auto frame_begin = std::chrono::steady_clock::now();
+
         glClear(GL_COLOR_BUFFER_BIT);
         glEnable(GL_BLEND);
         glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
@@ -91,11 +120,39 @@ namespace ns
             m_render_func();
 
         glutSwapBuffers();
+
+        float frame_ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - frame_begin).count();
+
+        std::lock_guard lock(m_frame_stats_mtx);
+        auto& stats = m_frame_stats;
+        stats.avg_ms = (stats.avg_ms * stats.n_frames + frame_ms) / (stats.n_frames + 1);
+        stats.max_ms = std::max(stats.max_ms, frame_ms);
+        stats.last_ms = frame_ms;
+        ++stats.n_frames;
+    }
+
+    void Window::timer_callback(int)
+    {
+        if (!g_window) return;
+        g_window->cb_timer();
+    }
+
+    void Window::cb_timer()
+    {
+        // Changes made since the last check are drawn in one frame
+        if (m_is_dirty.exchange(false))
+            glutPostRedisplay();
+
+        // Without a cap the timer would poll, so it waits at least a few milliseconds
+        int frame_cap = m_frame_cap;
+        int interval = frame_cap > 0 ? 1000 / frame_cap : 0;
+        glutTimerFunc(std::max(interval, MIN_TIMER_INTERVAL_MS), timer_callback, 0);
     }
 
     void Window::cb_mouse_move_event(int x, int y)
     {
-        m_events.push(new MouseMoveEvent((float)x / m_width, (float)y / m_height));
+        // Moves are dropped while the ring is half full, they are superseded by the next one anyway
+        m_events.push(MouseMoveEvent((float)x / m_width, (float)y / m_height));
     }
 
     void Window::cb_mouse_button_event(int button, int state, int x, int y)
@@ -116,17 +173,20 @@ namespace ns
             default: assert(false && "Unhandled button state");
         }
 
-        m_events.push(new MouseButtonEvent((float)x / m_width, (float)y / m_height, btn, st));
+        if (!m_events.push(MouseButtonEvent((float)x / m_width, (float)y / m_height, btn, st)))
+            printf("Event queue full, dropped mouse button event\n");
     }
 
     void Window::cb_keyboard_down_event(unsigned char key, int x, int y)
     {
-        m_events.push(new KeyboardEvent((float)x / m_width, (float)y / m_height, key, KeyboardEvent::State::Down));
+        if (!m_events.push(KeyboardEvent((float)x / m_width, (float)y / m_height, key, KeyboardEvent::State::Down)))
+            printf("Event queue full, dropped keyboard event\n");
     }
 
     void Window::cb_keyboard_up_event(unsigned char key, int x, int y)
     {
-        m_events.push(new KeyboardEvent((float)x / m_width, (float)y / m_height, key, KeyboardEvent::State::Up));
+        if (!m_events.push(KeyboardEvent((float)x / m_width, (float)y / m_height, key, KeyboardEvent::State::Up)))
+            printf("Event queue full, dropped keyboard event\n");
     }
 
     void Window::cb_reshape(int width, int height)
@@ -135,6 +195,8 @@ namespace ns
         m_height = height;
 
         glViewport(0, 0, m_width, m_height);
+
+        invalidate();
     }
 
     bool Window::is_alive()